@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Street map drawn underneath the route, from the file given with
+ * basemap=<path>. The file is made on the host by mkbasemap.py out of
+ * Tiger/Line shapefiles or OpenStreetMap extracts.
+ *
+ * The roads are projected on a Transverse Mercator grid of their own and cut
+ * into square tiles. There are a couple of levels of detail, every next level
+ * has tiles that are 8 times larger, coarser units, fewer points and only the
+ * bigger roads. Within a tile a road is a class byte, a point count and the
+ * points as pairs of 16-bit deltas, the first one from the corner of the tile.
+ *
+ * Our map grid is centered somewhere else, so the basemap grid is mapped onto
+ * it with an affine transform that is set up around our position, and applied
+ * in fixed point to the points of every tile we draw.
+ *
+ * Tiles go through the tile cache. Once per fix we look at where we'll be in
+ * the next couple of minutes, going by our speed and heading and by the route
+ * ahead of us. When a tile we'll soon need isn't in the cache, all the tiles
+ * along the way are read in one go, so the disk can spin down again.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gpsapp.h"
+#include "metrics.h"
+
+#define BASEMAP_MAGIC "GMAP"
+#define BASEMAP_VERSION 1
+#define BASEMAP_HDR 24
+#define BASEMAP_LEVEL 16
+#define MAX_LEVELS 4
+#define JAC_STEP 1e-4		/* radians, about 600m */
+#define PREFETCH_SECS 120	/* how far ahead we look for tiles */
+#define PREFETCH_MAX 16		/* tiles read in one go */
+#define MAX_AHEAD 64
+#define MIN_SPEED 2000		/* m/h, below that our heading is noise */
+
+/* header, all values little endian
+ *  0 magic, 4 version (16 bits), 6 number of levels (16 bits)
+ *  8 latitude, 12 longitude of the center of the grid (microdegrees)
+ * 16 log2 of the tile size of level 0 in meters (16 bits)
+ * 18 log2 of the growth from one level to the next (16 bits), 20 unused
+ *
+ * followed by a header for every level
+ *  0 column, 4 row of the first tile, 8 columns, 10 rows (16 bits)
+ * 12 offset of the tile directory
+ *
+ * the directory has the offset and size of every tile, row by row. Empty
+ * tiles have size 0. A tile is the number of lines (16 bits), followed by
+ * the lines, a class, the number of points and the points */
+
+struct level {
+    int tx0, ty0, ncols, nrows;
+    int tile_shift, unit_shift;
+    unsigned int *dir;
+};
+
+/* a tile we're about to need, dist meters ahead of us */
+struct ahead {
+    int tx, ty, dist;
+};
+
+char *basemapfile = NULL;
+
+static int fd = -1;
+static struct coord origin;	/* center of the basemap grid */
+static struct level levels[MAX_LEVELS];
+static int nlevels, level_shift;
+
+/* the level and half the size of the view we last drew, in meters */
+static int view_level = -1, view_w, view_h;
+
+/* basemap grid to map grid, v = v0 + m (b - b0) */
+static double anchor_lat, anchor_lon, center_lat, center_lon;
+static double b0x, b0y, v0x, v0y, m[4], minv[4];
+static int fm[4];		/* m in 16.16 fixed point */
+
+/* what basemap_next is working on */
+static struct level *lvl;
+static int tx_min, tx_max, ty_min, ty_max, cur_tx, cur_ty;
+static unsigned char *pos, *end;
+static int nlines, tile_x, tile_y;
+
+static unsigned int get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int readat(void *buf, int len, off_t offset)
+{
+    int n, done = 0;
+
+    if (lseek(fd, offset, SEEK_SET) != offset)
+	return -1;
+
+    while (done < len && (n = read(fd, (char *)buf + done, len - done)) > 0)
+	done += n;
+    return done == len ? 0 : -1;
+}
+
+static int read_levels(int tile_shift)
+{
+    unsigned char hdr[BASEMAP_LEVEL];
+    struct level *l;
+    int i, j, n;
+
+    for (i = 0; i < nlevels; i++) {
+	l = &levels[i];
+	if (readat(hdr, BASEMAP_LEVEL, BASEMAP_HDR + i * BASEMAP_LEVEL) == -1)
+	    return -1;
+
+	l->tx0 = (int)get32(&hdr[0]);
+	l->ty0 = (int)get32(&hdr[4]);
+	l->ncols = get16(&hdr[8]);
+	l->nrows = get16(&hdr[10]);
+	l->tile_shift = tile_shift + i * level_shift;
+	l->unit_shift = i * level_shift;
+
+	n = l->ncols * l->nrows * 2;
+	l->dir = malloc(n * sizeof(unsigned int));
+	if (!l->dir || readat(l->dir, n * 4, get32(&hdr[12])) == -1)
+	    return -1;
+
+	/* the directory is little endian, like the rest */
+	for (j = 0; j < n; j++)
+	    l->dir[j] = get32((unsigned char *)&l->dir[j]);
+    }
+    return 0;
+}
+
+void basemap_open(void)
+{
+    unsigned char hdr[BASEMAP_HDR];
+    int tile_shift;
+
+    if (!basemapfile || fd != -1)
+	return;
+
+    fd = open(basemapfile, O_RDONLY);
+    if (fd == -1)
+	return;
+
+    if (readat(hdr, BASEMAP_HDR, 0) == -1 ||
+	memcmp(hdr, BASEMAP_MAGIC, 4) != 0 ||
+	get16(&hdr[4]) != BASEMAP_VERSION)
+	goto bad;
+
+    nlevels = get16(&hdr[6]);
+    origin.lat = degtorad((int)get32(&hdr[8]) / 1000000.0);
+    origin.lon = degtorad((int)get32(&hdr[12]) / 1000000.0);
+    tile_shift = get16(&hdr[16]);
+    level_shift = get16(&hdr[18]);
+
+    /* the points of a tile are scaled down by 16 - unit_shift bits */
+    if (nlevels < 1 || nlevels > MAX_LEVELS || !level_shift ||
+	tile_shift + (nlevels - 1) * level_shift > 24 ||
+	(nlevels - 1) * level_shift > 16)
+	goto bad;
+
+    if (read_levels(tile_shift) == -1)
+	goto bad;
+
+    anchor_lat = anchor_lon = 0.0;
+    return;
+
+bad:
+    basemap_close();
+}
+
+void basemap_close(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_LEVELS; i++) {
+	if (levels[i].dir)
+	    free(levels[i].dir);
+	levels[i].dir = NULL;
+    }
+    nlevels = 0;
+    lvl = NULL;
+    view_level = -1;
+
+    if (fd != -1) {
+	tilecache_flush(fd);
+	close(fd);
+    }
+    fd = -1;
+}
+
+/* the transform is only valid around where we are, the distortion of both
+ * grids differs a bit more the further we are from their centers */
+static int basemap_anchor(void)
+{
+    double lat, lon, b[4], v[4], det, x, y;
+    int i;
+
+    if (gps_coord.lat == 0.0 && gps_coord.lon == 0.0) {
+	if (coord_center.lat == 0.0 && coord_center.lon == 0.0)
+	    return 0;
+	lat = coord_center.lat;
+	lon = coord_center.lon;
+    } else {
+	lat = gps_coord.lat;
+	lon = gps_coord.lon;
+    }
+
+    if (fabs(lat - anchor_lat) < JAC_STEP && fabs(lon - anchor_lon) < JAC_STEP &&
+	coord_center.lat == center_lat && coord_center.lon == center_lon)
+	return 1;
+
+    anchor_lat = lat;
+    anchor_lon = lon;
+    center_lat = coord_center.lat;
+    center_lon = coord_center.lon;
+
+    /* how both grids change with latitude and longitude, in columns */
+    projectTM(&origin, lat, lon, &b0x, &b0y);
+    projectTM(&origin, lat + JAC_STEP, lon, &x, &y);
+    b[0] = x - b0x; b[2] = y - b0y;
+    projectTM(&origin, lat, lon + JAC_STEP, &x, &y);
+    b[1] = x - b0x; b[3] = y - b0y;
+
+    projectTM(&coord_center, lat, lon, &v0x, &v0y);
+    projectTM(&coord_center, lat + JAC_STEP, lon, &x, &y);
+    v[0] = x - v0x; v[2] = y - v0y;
+    projectTM(&coord_center, lat, lon + JAC_STEP, &x, &y);
+    v[1] = x - v0x; v[3] = y - v0y;
+
+    /* m = v * b^-1, minv = b * v^-1 */
+    det = b[0] * b[3] - b[1] * b[2];
+    m[0] = (v[0] * b[3] - v[1] * b[2]) / det;
+    m[1] = (v[1] * b[0] - v[0] * b[1]) / det;
+    m[2] = (v[2] * b[3] - v[3] * b[2]) / det;
+    m[3] = (v[3] * b[0] - v[2] * b[1]) / det;
+
+    det = m[0] * m[3] - m[1] * m[2];
+    minv[0] =  m[3] / det;
+    minv[1] = -m[1] / det;
+    minv[2] = -m[2] / det;
+    minv[3] =  m[0] / det;
+
+    for (i = 0; i < 4; i++)
+	fm[i] = m[i] * 65536.0;
+    return 1;
+}
+
+static unsigned int *tile_dir(const struct level *l, int tx, int ty)
+{
+    return &l->dir[((ty - l->ty0) * l->ncols + (tx - l->tx0)) * 2];
+}
+
+/* the tiles of level l that intersect the part of the map grid between min
+ * and max, returns 0 when there are none */
+static int tile_range(const struct level *l, const struct xy *min,
+		      const struct xy *max, int *txmin, int *txmax,
+		      int *tymin, int *tymax)
+{
+    double x, y, bx[4], by[4], xmin, xmax, ymin, ymax, size;
+    int i;
+
+    /* corners of the view on the basemap grid */
+    for (i = 0; i < 4; i++) {
+	x = ((i & 1) ? max->x : min->x) - v0x;
+	y = ((i & 2) ? max->y : min->y) - v0y;
+	bx[i] = b0x + minv[0] * x + minv[1] * y;
+	by[i] = b0y + minv[2] * x + minv[3] * y;
+    }
+    xmin = xmax = bx[0];
+    ymin = ymax = by[0];
+    for (i = 1; i < 4; i++) {
+	if (bx[i] < xmin) xmin = bx[i];
+	if (bx[i] > xmax) xmax = bx[i];
+	if (by[i] < ymin) ymin = by[i];
+	if (by[i] > ymax) ymax = by[i];
+    }
+
+    size = 1 << l->tile_shift;
+    *txmin = floor(xmin / size);
+    *txmax = floor(xmax / size);
+    *tymin = floor(ymin / size);
+    *tymax = floor(ymax / size);
+
+    if (*txmin < l->tx0) *txmin = l->tx0;
+    if (*tymin < l->ty0) *tymin = l->ty0;
+    if (*txmax >= l->tx0 + l->ncols) *txmax = l->tx0 + l->ncols - 1;
+    if (*tymax >= l->ty0 + l->nrows) *tymax = l->ty0 + l->nrows - 1;
+    return *txmin <= *txmax && *tymin <= *tymax;
+}
+
+/* sets up drawing the tiles that intersect the part of the map grid between
+ * min and max, returns 0 when there is nothing to draw */
+int basemap_begin(const struct xy *min, const struct xy *max, int scale)
+{
+    int level;
+
+    lvl = NULL;
+
+    if (fd == -1 || !basemap_anchor())
+	return 0;
+
+    /* a level is used from where its units are an eighth of a pixel */
+    level = (scale - 3) / level_shift;
+    if (level < 0) level = 0;
+    if (level >= nlevels) level = nlevels - 1;
+
+    view_level = level;
+    view_w = (max->x - min->x) / 2;
+    view_h = (max->y - min->y) / 2;
+
+    if (!tile_range(&levels[level], min, max, &tx_min, &tx_max,
+		    &ty_min, &ty_max))
+	return 0;
+
+    lvl = &levels[level];
+    cur_tx = tx_min - 1;
+    cur_ty = ty_min;
+    nlines = 0;
+    return 1;
+}
+
+/* on to the next tile with something in it */
+static int next_tile(void)
+{
+    unsigned int *dir;
+    double x, y;
+
+    while (1) {
+	if (++cur_tx > tx_max) {
+	    cur_tx = tx_min;
+	    if (++cur_ty > ty_max)
+		return 0;
+	}
+
+	dir = tile_dir(lvl, cur_tx, cur_ty);
+	if (dir[1] < 2)
+	    continue;
+
+	pos = tilecache_get(fd, dir[0], dir[1]);
+	if (!pos)
+	    continue;
+
+	end = pos + dir[1];
+	nlines = get16(pos);
+	pos += 2;
+
+	/* where the corner of the tile ends up on our map grid */
+	x = (double)cur_tx * (1 << lvl->tile_shift) - b0x;
+	y = (double)cur_ty * (1 << lvl->tile_shift) - b0y;
+	tile_x = floor(v0x + m[0] * x + m[1] * y + 0.5);
+	tile_y = floor(v0y + m[2] * x + m[3] * y + 0.5);
+	return 1;
+    }
+}
+
+/* decodes the next line onto our map grid, pts has to have room for
+ * BASEMAP_MAXPTS points. Returns the number of points, 0 when done */
+int basemap_next(struct xy *pts, int *class)
+{
+    long long ux, uy;
+    int i, n, shift;
+
+    if (!lvl)
+	return 0;
+
+    while (1) {
+	if (!nlines && !next_tile()) {
+	    lvl = NULL;
+	    return 0;
+	}
+	if (!nlines)
+	    continue;
+	nlines--;
+
+	/* a truncated tile, skip the rest of it */
+	if (pos + 2 > end || pos + 2 + pos[1] * 4 > end) {
+	    nlines = 0;
+	    continue;
+	}
+
+	*class = pos[0];
+	n = pos[1];
+	pos += 2;
+
+	/* fm is 16.16 and the units go up to the size of a tile, which
+	 * easily takes more than 32 bits */
+	shift = 16 - lvl->unit_shift;
+	ux = uy = 0;
+	for (i = 0; i < n; i++, pos += 4) {
+	    ux += (short)get16(pos);
+	    uy += (short)get16(pos + 2);
+	    pts[i].x = tile_x + ((fm[0] * ux + fm[1] * uy) >> shift);
+	    pts[i].y = tile_y + ((fm[2] * ux + fm[3] * uy) >> shift);
+	}
+	if (n > 1)
+	    return n;
+    }
+}
+
+static int ahead_cmp(const void *a, const void *b)
+{
+    return ((struct ahead *)a)->dist - ((struct ahead *)b)->dist;
+}
+
+/* remember the tiles we'll need when the view is centered on p, that aren't
+ * in the cache yet */
+static int ahead_add(struct ahead *a, int n, const struct xy *p, int dist)
+{
+    struct level *l = &levels[view_level];
+    struct xy min, max;
+    int tx, ty, x0, x1, y0, y1, i;
+
+    min.x = p->x - view_w; max.x = p->x + view_w;
+    min.y = p->y - view_h; max.y = p->y + view_h;
+    if (!tile_range(l, &min, &max, &x0, &x1, &y0, &y1))
+	return n;
+
+    for (ty = y0; ty <= y1; ty++)
+	for (tx = x0; tx <= x1; tx++) {
+	    unsigned int *dir = tile_dir(l, tx, ty);
+
+	    if (dir[1] < 2 || tilecache_has(fd, dir[0]))
+		continue;
+
+	    for (i = 0; i < n; i++)
+		if (a[i].tx == tx && a[i].ty == ty)
+		    break;
+	    if (i < n || n == MAX_AHEAD)
+		continue;
+
+	    a[n].tx = tx;
+	    a[n].ty = ty;
+	    a[n].dist = dist;
+	    n++;
+	}
+    return n;
+}
+
+/* called for every fix, reads the tiles we're heading for before they scroll
+ * into view */
+void basemap_prefetch(void)
+{
+    struct ahead a[MAX_AHEAD];
+    const struct xy *pts;
+    struct xy p, prev;
+    double seg, d, f;
+    int i, n = 0, npts, step, horizon, next, bytes = 0;
+    unsigned int *dir;
+
+    if (fd == -1 || view_level == -1 || !view_w || !basemap_anchor())
+	return;
+
+    /* a new view every half a view width, for the next couple of minutes */
+    step = view_w;
+    horizon = filter_speed() / 3600 * PREFETCH_SECS;
+    if (horizon < 4 * step)
+	horizon = 4 * step;
+
+    if (gps_bearing >= 0 && filter_speed() >= MIN_SPEED)
+	for (next = step; next <= horizon; next += step) {
+	    p.x = gps_coord.xy.x + next * sin(degtorad(gps_bearing));
+	    p.y = gps_coord.xy.y + next * cos(degtorad(gps_bearing));
+	    n = ahead_add(a, n, &p, next);
+	}
+
+    /* and along the route, we might turn off soon */
+    npts = route_ahead(&pts);
+    prev = gps_coord.xy;
+    d = 0.0;
+    next = 0;
+    for (i = 0; i < npts && next <= horizon; i++) {
+	seg = sqrt((double)distance2(&prev, &pts[i]));
+	while (next <= d + seg && next <= horizon) {
+	    f = seg ? (next - d) / seg : 0.0;
+	    p.x = prev.x + f * (pts[i].x - prev.x);
+	    p.y = prev.y + f * (pts[i].y - prev.y);
+	    n = ahead_add(a, n, &p, next);
+	    next += step;
+	}
+	d += seg;
+	prev = pts[i];
+    }
+
+    /* nothing missing that we need soon, let the disk sleep */
+    qsort(a, n, sizeof(struct ahead), ahead_cmp);
+    if (!n || a[0].dist > horizon / 2)
+	return;
+
+    /* but once it is spinning, get everything, without pushing the view we
+     * are drawing out of the cache */
+    for (i = 0; i < n && i < PREFETCH_MAX; i++) {
+	dir = tile_dir(&levels[view_level], a[i].tx, a[i].ty);
+	bytes += dir[1];
+	if (bytes > tilecache_size * 1024 / 2)
+	    break;
+	METRIC_COUNT(C_TILE_PREFETCH);
+	tilecache_get(fd, dir[0], dir[1]);
+    }
+}
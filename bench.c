@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Runs the route engine and the map renderer without a display or receiver.
+ * It loads the only route in <routedir>, then replays a gpstrans tracklog,
+ * locating and drawing a map frame and a text frame for every fix, and
+ * reports how long each of these took. Generate the input with mkroute.py,
+ * or just run 'make bench'. The fonts are read from empeg/lib/fonts, like
+ * gpsapp does, unless another directory is given. Without them the text
+ * frame isn't timed.
+ *
+ * usage: gpsapp_bench <routedir> <tracklog> [<fontdir>]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vfdlib.h"
+#include "gpsapp.h"
+
+#define MIN_TRACK_SPEED 2000	/* same as serial.c */
+#define FONTDIR "empeg/lib/fonts" /* same as gpsapp */
+
+/* what the rest of gpsapp normally provides */
+int show_metric, show_gpscoords, coord_format, show_popups = 1, show_time;
+int h0, do_refresh, framerate = 4, heading_up;
+char *statedir;
+struct gps_state gps_state;
+struct coord gps_coord;
+unsigned int gps_speed;
+int gps_bearing = -1;
+
+static int visual;
+static int have_fonts;	/* the text frame is only timed when we can draw it */
+
+int get_visual(void)
+{
+    return visual;
+}
+
+void empeg_updatedisplay(unsigned char *screen)
+{
+}
+
+char *state_path(char *buf, const char *name)
+{
+    snprintf(buf, PATH_MAX, "%s/%s", statedir, name);
+    return buf;
+}
+
+void timesub(struct timeval *res, struct timeval *from, struct timeval *val)
+{
+    res->tv_sec  = from->tv_sec  - val->tv_sec;
+    res->tv_usec = from->tv_usec - val->tv_usec;
+    if (res->tv_usec < 0) {
+	res->tv_sec--;
+	res->tv_usec += 1000000;
+    }
+}
+
+/* all samples are kept, so we can report percentiles */
+struct bench {
+    char *name;
+    unsigned int *usec;
+    int n, size;
+};
+
+static struct bench b_slice = { "load slice" };
+static struct bench b_project = { "project" };
+static struct bench b_locate = { "locate" };
+static struct bench b_map = { "map frame" };
+static struct bench b_rotated = { "heading up" };
+static struct bench b_text = { "text frame" };
+
+static void bench_add(struct bench *b, const struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timesub(&diff, &now, (struct timeval *)start);
+
+    if (b->n == b->size) {
+	b->size = b->size ? b->size * 2 : 1024;
+	b->usec = realloc(b->usec, b->size * sizeof(unsigned int));
+	if (!b->usec) {
+	    fprintf(stderr, "out of memory\n");
+	    exit(1);
+	}
+    }
+    b->usec[b->n++] = diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+static int cmp_usec(const void *a, const void *b)
+{
+    unsigned int x = *(unsigned int *)a, y = *(unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(struct bench *b)
+{
+    unsigned long long total = 0;
+    int i;
+
+    if (!b->n) {
+	printf("%-12s no samples\n", b->name);
+	return;
+    }
+
+    qsort(b->usec, b->n, sizeof(unsigned int), cmp_usec);
+    for (i = 0; i < b->n; i++)
+	total += b->usec[i];
+
+    printf("%-12s %8d %10llu %8llu %8u %8u %8u\n", b->name, b->n, total,
+	   total / b->n, b->usec[b->n / 2], b->usec[b->n * 99 / 100],
+	   b->usec[b->n - 1]);
+}
+
+/* how often the route was left, and rejoined */
+static int offroute[2];
+
+static void bench_offroute(int off)
+{
+    offroute[off]++;
+}
+
+static long maxrss(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* T	09/14/2002 13:52:20	39.6513319	-83.5433006 */
+static int read_fix(FILE *f, time_t *t, double *lat, double *lon)
+{
+    char buf[128];
+    int mon, day, year, hour, min, sec;
+    struct tm tm;
+
+    while (fgets(buf, sizeof(buf), f)) {
+	if (sscanf(buf, "T %d/%d/%d %d:%d:%d %lf %lf", &mon, &day, &year,
+		   &hour, &min, &sec, lat, lon) != 8)
+	    continue;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = mon - 1;
+	tm.tm_mday = day;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+	*t = mktime(&tm);
+	return 1;
+    }
+    return 0;
+}
+
+static void map_frame(void)
+{
+    struct xy pos;
+    int i;
+
+    draw_clear();
+    draw_scale();
+    draw_setview(&gps_coord.xy);
+    vfdlib_setClipArea(0, 0, VFD_WIDTH - VFD_HEIGHT, VFD_HEIGHT);
+    track_draw();
+    route_draw(&gps_coord.xy);
+    for (i = 0; route_getwp(i, &pos, NULL, NULL); i++) {
+	draw_point(&pos, VFDSHADE_BRIGHT);
+	if (i == nextwp)
+	    draw_mark(&pos, -1, VFDSHADE_MEDIUM);
+    }
+    draw_mark(&gps_coord.xy, gps_bearing, VFDSHADE_BRIGHT);
+    vfdlib_setClipArea(0, 0, VFD_WIDTH, VFD_HEIGHT);
+    draw_info();
+    draw_display();
+}
+
+static void text_frame(void)
+{
+    draw_clear();
+    draw_wpstext();
+    draw_display();
+}
+
+static void drive(FILE *f)
+{
+    struct timeval start, stamp;
+    struct xy last;
+    time_t t, last_t = 0;
+    double lat, lon, dt;
+
+    while (read_fix(f, &t, &lat, &lon)) {
+	gps_state.time = t;
+	gps_state.lat = gps_coord.lat = degtorad(lat);
+	gps_state.lon = gps_coord.lon = degtorad(lon);
+	gps_state.fix = 3;
+	route_recenter();
+
+	gettimeofday(&start, NULL);
+	toTM(&gps_coord);
+	bench_add(&b_project, &start);
+
+	/* the tracklog has no velocities, so make them up */
+	dt = last_t ? t - last_t : 0;
+	gps_state.spd_east = dt > 0 ? (gps_coord.xy.x - last.x) / dt : 0.0;
+	gps_state.spd_north = dt > 0 ? (gps_coord.xy.y - last.y) / dt : 0.0;
+	last = gps_coord.xy;
+	last_t = t;
+
+	stamp.tv_sec = t;
+	stamp.tv_usec = 0;
+	filter_fix(&gps_coord.xy, dt > 0, gps_state.spd_east,
+		   gps_state.spd_north, &stamp);
+	gps_bearing = filter_heading();
+	if (filter_speed() >= MIN_TRACK_SPEED)
+	    track_pos();
+
+	gettimeofday(&start, NULL);
+	route_locate();
+	bench_add(&b_locate, &start);
+
+	if (filter_speed() >= MIN_TRACK_SPEED)
+	    route_update_vmg();
+
+	visual = 1;
+	gettimeofday(&start, NULL);
+	map_frame();
+	bench_add(&b_map, &start);
+
+	heading_up = 1;
+	gettimeofday(&start, NULL);
+	map_frame();
+	bench_add(&b_rotated, &start);
+	heading_up = 0;
+
+	if (!have_fonts)
+	    continue;
+
+	visual = 2;
+	gettimeofday(&start, NULL);
+	text_frame();
+	bench_add(&b_text, &start);
+    }
+}
+
+/* we don't want to learn leg times from one run to the next */
+static void cleanup(void)
+{
+    char buf[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(statedir);
+    if (!d) return;
+    while ((de = readdir(d)) != NULL) {
+	if (de->d_name[0] == '.') continue;
+	unlink(state_path(buf, de->d_name));
+    }
+    closedir(d);
+    rmdir(statedir);
+}
+
+int main(int argc, char **argv)
+{
+    char buf[PATH_MAX], tmpdir[] = "/tmp/gpsapp_bench.XXXXXX";
+    const char *fontdir = FONTDIR;
+    struct timeval start, loaded;
+    long rss;
+    FILE *f;
+
+    if (argc < 3) {
+	fprintf(stderr, "usage: %s <routedir> <tracklog> [<fontdir>]\n",
+		argv[0]);
+	exit(1);
+    }
+    routedir = argv[1];
+    if (argc > 3)
+	fontdir = argv[3];
+
+    f = fopen(argv[2], "r");
+    if (!f) {
+	perror(argv[2]);
+	exit(1);
+    }
+
+    statedir = mkdtemp(tmpdir);
+    if (!statedir) {
+	perror("mkdtemp");
+	exit(1);
+    }
+
+    /* without fonts we still draw the map, but the text is skipped and
+     * there's no point in timing the text frame */
+    snprintf(buf, sizeof(buf), "%s/small.bf", fontdir);
+    have_fonts = vfdlib_registerFont(buf, 0) >= 0;
+    if (!have_fonts)
+	fprintf(stderr, "no fonts in %s, the text frame isn't timed\n",
+		fontdir);
+    snprintf(buf, sizeof(buf), "%s/large.bf", fontdir);
+    vfdlib_registerFont(buf, 1);
+    h0 = vfdlib_getTextHeight(0);
+
+    eta_init();
+    route_init();
+    route_offroute_hook = bench_offroute;
+    rss = maxrss();
+
+    gettimeofday(&start, NULL);
+    if (!routes_init()) {
+	fprintf(stderr, "no routes in %s\n", routedir);
+	cleanup();
+	exit(1);
+    }
+    route_load();
+    while (1) {
+	struct timeval slice;
+	int more;
+
+	gettimeofday(&slice, NULL);
+	more = route_poll();
+	bench_add(&b_slice, &slice);
+	if (!more) break;
+    }
+    gettimeofday(&loaded, NULL);
+    timesub(&loaded, &loaded, &start);
+
+    printf("route %s, loaded in %ld.%06ld s, %ld KB\n",
+	   routes_selected() ? routes_selected()->name : "?",
+	   (long)loaded.tv_sec, (long)loaded.tv_usec, maxrss() - rss);
+
+    drive(f);
+    fclose(f);
+
+    printf("%-12s %8s %10s %8s %8s %8s %8s (usec)\n", "", "n", "total",
+	   "avg", "median", "99%", "max");
+    bench_report(&b_slice);
+    bench_report(&b_project);
+    bench_report(&b_locate);
+    bench_report(&b_map);
+    bench_report(&b_rotated);
+    if (have_fonts)
+	bench_report(&b_text);
+    printf("off route %d times, back on %d times\n", offroute[1], offroute[0]);
+    printf("max rss %ld KB\n", maxrss());
+
+    route_init();
+    eta_free();
+    cleanup();
+    return 0;
+}
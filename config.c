@@ -1,123 +1,256 @@
-#include <stdio.h>
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Reads the [gpsapp] section of the player's config.ini. The file is read
+ * whole and split into key=value pairs in place, in a single pass. Every key
+ * is looked up in the table of options passed in by the caller, and handed to
+ * the handler of that option. Unknown keys are ignored, just like the player
+ * does.
+ *
+ * While we're running we notice when the file changes, through inotify when
+ * built with HAVE_INOTIFY, otherwise by checking its mtime once a second.
+ * Options that are changed from the menu are saved in a file of their own.
+ */
+
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 #include "gpsapp.h"
 
-static char *
-findchars (char *s, char *chars)
+static const char *val0[] = { "off", "no", "0", "false", "sats", "ddd", NULL };
+static const char *val1[] = { "on", "yes", "1", "true", "map", "dmm", NULL };
+static const char *val2[] = { "permanent", "route", "dms", NULL };
+static const char **vals[] = { val0, val1, val2 };
+
+/* on, off, permanent, or a plain number, up to opt->max */
+int config_choice(const struct config_option *opt, char *value)
 {
-        char c, *k;
-
-        while ((c = *s)) {
-                for (k = chars; *k; ++k) {
-                        if (c == *k)
-                                return s;
-                }
-                ++s;
-        }
-        return s;
+    int i, n;
+
+    for (n = 0; n <= opt->max && n < 3; n++)
+	for (i = 0; vals[n][i]; i++)
+	    if (!strcasecmp(value, vals[n][i])) {
+		*(int *)opt->var = n;
+		return 0;
+	    }
+    return config_int(opt, value);
 }
 
-static char *
-skipchars (char *s, char *chars)
+int config_int(const struct config_option *opt, char *value)
 {
-        char c, *k;
-
-        skip: while ((c = *s)) {
-                for (k = chars; *k; ++k) {
-                        if (c == *k) {
-                                ++s;
-                                goto skip;
-                        }
-                }
-                break;
-        }
-        return s;
+    char *end;
+    long n;
+
+    n = strtol(value, &end, 10);
+    if (end == value || *end || n < 0 || n > opt->max)
+	return -1;
+
+    *(int *)opt->var = n;
+    return 0;
 }
 
-static char *
-find_header (char *s, const char *header)
+int config_string(const struct config_option *opt, char *value)
 {
-  if (!s || !*s || !(s = strstr(s, header)) || !*s || !*(s += strlen(header)))
-    s = NULL;
-  return s;
+    char **var = opt->var, *s;
+
+    s = strdup(value);
+    if (!s) return -1;
+
+    if (*var) free(*var);
+    *var = s;
+    return 0;
 }
 
-const char *val0[] = { "off", "no", "0", "false", "sats", "ddd", NULL };
-const char *val1[] = { "on", "yes", "1", "true", "map", "dmm", NULL };
-const char *val2[] = { "permanent", "route", "dms", NULL };
+static char *trim(char *s, char *end)
+{
+    while (s < end && (*s == ' ' || *s == '\t'))
+	s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+	end--;
+    *end = '\0';
+    return s;
+}
 
-int
-config_ini_option (char *s, char *match, int *inside)
+static void config_parse(char *buf, char *end,
+			 const struct config_option *options, int reload)
 {
-  if (!(*inside) && !(s = find_header(s, CONFIG_HEADER))) {
-    return -1;
-  }
-
-  while (*(s = skipchars(s, " \n\t\r")) && *s != '[') {
-    char *f;
-
-    if (*s == ';') {
-      /* ignore comment */
-    } else {
-      if ((f = findchars(s, "="))) {
-	if (strncmp(s,match,f-s) == 0) {
-          int i, len;
-	  char *eof = findchars(s, "\n");
-	  if (!eof)
-	    eof = findchars(s, "\0");
-	  if (!eof)
-	    return -1;
-
-	  /* Special handling for "protocol" */
-	  if (!strcmp(match, "protocol")) {
-	    char proto_name[12]; /* Be stingy, but we may need more later? */
-	    int sz = ((eof-(f+1))>11)?11:(eof-(f+1)); /* reserve \0 */
-
-	    strncpy(proto_name, (char *)f+1, sz); /* maybe no \0 */
-	    proto_name[sz] = '\0'; 
-	    serial_protocol(proto_name); /* safe due to nmea default later */
-	    return 0;
-	  }
-
-	  /* Special handling for "serialport" */
-	  if (!strcmp(match, "serialport")) {
-	    int sz = (eof-(f+1)); /* reserve \0 */
-	    serport=(char *)malloc(sz);
-	    strncpy(serport, (char *)f+1, sz); /* maybe no \0 */
-	    serport[sz] = '\0'; 
-	    return 0;
-	  }
-
-	  /* Special handling for "serialport" */
-	  if (!strcmp(match, "routedir")) {
-	    int sz = (eof-(f+1)); /* reserve \0 */
-	    routedir=(char *)malloc(sz);
-	    strncpy(routedir, (char *)f+1, sz); /* maybe no \0 */
-	    routedir[sz] = '\0'; 
-	    return 0;
-	  }
-
-	  len = eof - (f+1);
-	  for (i = 0; val2[i] != NULL; i++)
-	      if (!strncasecmp((char *)f+1, val2[i], len))
-		  return 2;
-
-	  for (i = 0; val1[i] != NULL; i++)
-	      if (!strncasecmp((char *)f+1, val1[i], len))
-		  return 1;
-
-	  for (i = 0; val0[i] != NULL; i++)
-	      if (!strncasecmp((char *)f+1, val0[i], len))
-		  return 0;
+    const struct config_option *opt;
+    char *line, *eol, *eq, *key, *value;
+    int inside = 0;
+
+    for (line = buf; line < end; line = eol + 1) {
+	eol = memchr(line, '\n', end - line);
+	if (!eol)
+	    eol = end;
+
+	line = trim(line, eol);
+	if (*line == '[')
+	    inside = !strncasecmp(line, CONFIG_HEADER, CONFIG_HDRLEN);
+
+	else if (inside && *line != ';' && (eq = strchr(line, '=')) != NULL) {
+	    key = trim(line, eq);
+	    value = trim(eq + 1, eq + 1 + strlen(eq + 1));
+
+	    for (opt = options; opt->name; opt++)
+		if (!strcasecmp(key, opt->name)) {
+		    /* things like the serial port are only set up once */
+		    if (!reload || !(opt->flags & CONFIG_STARTUP))
+			opt->handler(opt, value);
+		    break;
+		}
 	}
-      } 
     }
-    s = findchars(s, "\n");
-  }
+}
+
+/* returns -1 when the file couldn't be read */
+int config_read(const char *path, const struct config_option *options,
+		int reload)
+{
+    struct stat st;
+    char *buf;
+    int fd, n, len = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return -1;
+
+    if (fstat(fd, &st) == -1 || !(buf = malloc(st.st_size + 1))) {
+	close(fd);
+	return -1;
+    }
+
+    while (len < st.st_size &&
+	   (n = read(fd, buf + len, st.st_size - len)) > 0)
+	len += n;
+    close(fd);
+    buf[len] = '\0';
+
+    config_parse(buf, buf + len, options, reload);
+    free(buf);
+    return 0;
+}
+
+/* write the current value of the CONFIG_MENU options, in the same format so
+ * config_read can read them back. Written to a temporary file first, so we
+ * never end up with half a file */
+int config_save(const char *path, const struct config_option *options)
+{
+    const struct config_option *opt;
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) return -1;
+
+    fprintf(f, "%s\n", CONFIG_HEADER);
+    for (opt = options; opt->name; opt++)
+	if (opt->flags & CONFIG_MENU)
+	    fprintf(f, "%s=%d\n", opt->name, *(int *)opt->var);
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+	fclose(f);
+	unlink(tmp);
+	return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+	unlink(tmp);
+	return -1;
+    }
+    return 0;
+}
+
+static const char *watch_path;
+static time_t watch_mtime, watch_checked;
+static off_t watch_size;
+#ifdef HAVE_INOTIFY
+static int watch_fd = -1;
+#endif
+
+void config_watch(const char *path)
+{
+    struct stat st;
+#ifdef HAVE_INOTIFY
+    char dir[PATH_MAX], *p;
+#endif
+
+    watch_path = path;
+    if (stat(path, &st) == 0) {
+	watch_mtime = st.st_mtime;
+	watch_size = st.st_size;
+    }
+
+#ifdef HAVE_INOTIFY
+    /* watch the directory, editors tend to replace the file */
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    p = strrchr(dir, '/');
+    if (p) *p = '\0';
+    else strcpy(dir, ".");
+
+    watch_fd = inotify_init();
+    if (watch_fd == -1)
+	return;
+
+    fcntl(watch_fd, F_SETFL, O_RDONLY | O_NONBLOCK);
+    if (inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+	close(watch_fd);
+	watch_fd = -1;
+    }
+#endif
+}
+
+/* returns 1 when the watched file was changed since the last call */
+int config_changed(void)
+{
+    struct stat st;
+    time_t now;
+#ifdef HAVE_INOTIFY
+    char buf[1024], *p;
+    const char *name;
+    struct inotify_event *ev;
+    int n, changed = 0;
+
+    if (watch_fd != -1) {
+	name = strrchr(watch_path, '/');
+	name = name ? name + 1 : watch_path;
+
+	while ((n = read(watch_fd, buf, sizeof(buf))) > 0)
+	    for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->len && !strcmp(ev->name, name))
+		    changed = 1;
+	    }
+	return changed;
+    }
+#endif
+
+    if (!watch_path)
+	return 0;
+
+    now = time(NULL);
+    if (now == watch_checked)
+	return 0;
+    watch_checked = now;
 
-  if (*s != '[') *inside = 0;
+    if (stat(watch_path, &st) == -1 ||
+	(st.st_mtime == watch_mtime && st.st_size == watch_size))
+	return 0;
 
-  return -1;
+    watch_mtime = st.st_mtime;
+    watch_size = st.st_size;
+    return 1;
 }
@@ -8,15 +8,12 @@
 #include <time.h>
 #include <stdlib.h>
 #include "gpsapp.h"
+#include "metrics.h"
 
 #define WGS84_a    6378137.0
 #define WGS84_invf 298.257223563
 #define UTM_k0	   0.9996
 
-int stats_toTM;
-int stats_distance;
-int stats_bearing;
-
 /* buf needs to be at least 10 characters */
 char *formatdist(char *buf, const unsigned int dist)
 {
@@ -71,24 +68,16 @@ char *formatspeed(char *buf, const int speed)
 }
 
 /* buf needs to be at least 10 characters */
-char *time_estimate(char *buf, const unsigned int dist)
+char *time_estimate(char *buf, const int wp, const unsigned int dist)
 {
     int hour, min;
-    time_t sec;
-    int vmg = abs(gps_avgvmg >> AVGVMG_SHIFT);
+    time_t sec = eta_seconds(wp, dist);
 
-    if (!dist) {
-	sprintf(buf, "00m00");
-	return buf;
-    }
-
-    if (!vmg) {
+    if (sec == -1) {
 	sprintf(buf, "--?--");
 	return buf;
     }
 
-    sec = (dist * 3600) / vmg;
-
     min  = sec / 60;
     sec -= min * 60;
     hour = min / 60;
@@ -156,16 +145,13 @@ static double M(const double phi)
 		      (35.0 * es3 / 3072.0) * sin(6.0 * phi));
 }
 
-void toTM(struct coord *point)
+/* project lat/lon relative to center, without rounding to whole meters */
+void projectTM(const struct coord *center, double phi, double lambda,
+	       double *x, double *y)
 {
-    double phi, phi0, lambda, lambda0;
+    double phi0, lambda0;
     double m, m0, sin_phi, cos_phi, tan_phi, es, et2, n, t, c, A;
 
-    struct coord *center = &coord_center;
-    struct xy *xy = &point->xy;
-
-    phi     = point->lat;
-    lambda  = point->lon;
     phi0    = center->lat;
     lambda0 = center->lon;
 
@@ -186,15 +172,66 @@ void toTM(struct coord *point)
     c = et2 * cos_phi * cos_phi;
     A = (lambda - lambda0) * cos_phi;
     
-    xy->x = UTM_k0 * n * (A + (1.0 - t + c) * A * A * A / 6.0 +
-			  (5.0 - 18.0 * t + t * t + 72.0 * c - 58.0 * et2) *
-			  A * A * A * A * A / 120.0);
-    xy->y = UTM_k0 * (m - m0 + n * tan(phi) *
-		      (A * A / 2.0 + (5.0 - t + 9.0 * c + 4 * c * c) *
-		       A * A * A * A / 24.0 +
-		       (61.0 - 58.0 * t + t * t + 600.0 * c - 330.0 * et2) *
-		       A * A * A * A * A * A / 720.0));
-    stats_toTM++;
+    *x = UTM_k0 * n * (A + (1.0 - t + c) * A * A * A / 6.0 +
+		       (5.0 - 18.0 * t + t * t + 72.0 * c - 58.0 * et2) *
+		       A * A * A * A * A / 120.0);
+    *y = UTM_k0 * (m - m0 + n * tan(phi) *
+		   (A * A / 2.0 + (5.0 - t + 9.0 * c + 4 * c * c) *
+		    A * A * A * A / 24.0 +
+		    (61.0 - 58.0 * t + t * t + 600.0 * c - 330.0 * et2) *
+		    A * A * A * A * A * A / 720.0));
+}
+
+/* and back from the grid around center to lat/lon (Snyder, USGS PP 1395) */
+void inverseTM(const struct coord *center, double x, double y,
+	       double *phi, double *lambda)
+{
+    double es, et2, e1, mu, phi1, sin_phi1, cos_phi1, tan_phi1;
+    double n1, r1, t1, c1, d, w;
+
+    es  = 0.0066943799901413165; // f * (2.0 - f);
+    et2 = 0.0067394967422764341; // es / (1.0 - es);
+    e1  = 0.0016792203863836958; // (1 - sqrt(1 - es)) / (1 + sqrt(1 - es));
+
+    mu = (M(center->lat) + y / UTM_k0) /
+	(WGS84_a * (1.0 - es/4.0 - 3.0*es*es/64.0 - 5.0*es*es*es/256.0));
+
+    phi1 = mu + (3.0*e1/2.0 - 27.0*e1*e1*e1/32.0) * sin(2.0 * mu) +
+	(21.0*e1*e1/16.0 - 55.0*e1*e1*e1*e1/32.0) * sin(4.0 * mu) +
+	(151.0*e1*e1*e1/96.0) * sin(6.0 * mu) +
+	(1097.0*e1*e1*e1*e1/512.0) * sin(8.0 * mu);
+
+    sin_phi1 = sin(phi1);
+    cos_phi1 = cos(phi1);
+    tan_phi1 = tan(phi1);
+
+    w  = 1.0 - es * sin_phi1 * sin_phi1;
+    n1 = WGS84_a / sqrt(w);
+    r1 = WGS84_a * (1.0 - es) / (w * sqrt(w));
+    t1 = tan_phi1 * tan_phi1;
+    c1 = et2 * cos_phi1 * cos_phi1;
+    d  = x / (n1 * UTM_k0);
+
+    *phi = phi1 - (n1 * tan_phi1 / r1) *
+	(d * d / 2.0 -
+	 (5.0 + 3.0 * t1 + 10.0 * c1 - 4.0 * c1 * c1 - 9.0 * et2) *
+	 d * d * d * d / 24.0 +
+	 (61.0 + 90.0 * t1 + 298.0 * c1 + 45.0 * t1 * t1 - 252.0 * et2 -
+	  3.0 * c1 * c1) * d * d * d * d * d * d / 720.0);
+    *lambda = center->lon +
+	(d - (1.0 + 2.0 * t1 + c1) * d * d * d / 6.0 +
+	 (5.0 - 2.0 * c1 + 28.0 * t1 - 3.0 * c1 * c1 + 8.0 * et2 +
+	  24.0 * t1 * t1) * d * d * d * d * d / 120.0) / cos_phi1;
+}
+
+void toTM(struct coord *point)
+{
+    double x, y;
+
+    projectTM(&coord_center, point->lat, point->lon, &x, &y);
+    point->xy.x = x;
+    point->xy.y = y;
+    METRIC_COUNT(C_TOTM);
 }
 
 long long distance2(const struct xy *coord1, const struct xy *coord2)
@@ -203,7 +240,7 @@ long long distance2(const struct xy *coord1, const struct xy *coord2)
     dx = coord1->x - coord2->x;
     dy = coord1->y - coord2->y;
     dist = dx * dx + dy * dy;
-    stats_distance++;
+    METRIC_COUNT(C_DISTANCE);
     return dist;
 }
 
@@ -218,7 +255,7 @@ double bearing(const struct xy *coord1, const struct xy *coord2)
 
     b = atan2(dx, dy);
 
-    stats_bearing++;
+    METRIC_COUNT(C_BEARING);
     return b;
 }
 
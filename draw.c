@@ -18,6 +18,15 @@
 
 static unsigned char screen[VFD_HEIGHT * VFD_BYTES_PER_SCANLINE];
 static int map_scale = 4;
+static struct xy view; /* map coordinates shown at the center of the map */
+
+/* With heading_up the map is turned so that where we're going is up. The
+ * rotation is set up once per frame in draw_setview, in 2.14 fixed point. */
+#define ROT_SHIFT 14
+#define ROT_MAX (1 << 16) /* pixels, closer than this fits in 32 bits */
+static int rotate, rot_hdg, rot_cos = 1 << ROT_SHIFT, rot_sin;
+static int view_hx = MAX_X / 2, view_hy = MAX_Y / 2; /* bounding box of the
+							 turned view */
 
 void draw_activity(int refresh)
 {
@@ -56,12 +65,78 @@ void draw_zoom(int inout)
     }
 }
 
+void draw_setview(const struct xy *pos)
+{
+    int hdg = rot_hdg, one = 1 << ROT_SHIFT;
+    double a;
+
+    view = *pos;
+
+    /* keep the last heading while we're standing still */
+    if (!heading_up)		hdg = 0;
+    else if (gps_bearing != -1) hdg = gps_bearing;
+
+    rotate = hdg != 0;
+    if (hdg == rot_hdg)
+	return;
+
+    rot_hdg = hdg;
+    a = degtorad((double)hdg);
+    rot_cos = floor(cos(a) * one + 0.5);
+    rot_sin = floor(sin(a) * one + 0.5);
+
+    view_hx = (abs(rot_cos) * (MAX_X / 2) + abs(rot_sin) * (MAX_Y / 2) +
+	       one - 1) >> ROT_SHIFT;
+    view_hy = (abs(rot_sin) * (MAX_X / 2) + abs(rot_cos) * (MAX_Y / 2) +
+	       one - 1) >> ROT_SHIFT;
+}
+
+/* Where pos is relative to the view, scaled to pixels but not turned yet.
+ * Returns on which sides of a square around the view it is, the square
+ * holds the view however it is turned, so a line with both ends on the same
+ * side can be dropped without turning them. */
+#define VIEW_R 52 /* half the diagonal of the map, rounded up */
+static inline int offset(const struct xy *pos, struct xy *d)
+{
+    int out = 0;
+
+    d->x = (pos->x - view.x) >> map_scale;
+    d->y = (pos->y - view.y) >> map_scale;
+
+    if (d->x < -VIEW_R) out |= 0x1;
+    else if (d->x > VIEW_R) out |= 0x2;
+    if (d->y < -VIEW_R) out |= 0x4;
+    else if (d->y > VIEW_R) out |= 0x8;
+    return out;
+}
+
+/* turn the offset from the view, and place it on the screen */
+static inline void turn(const struct xy *d, struct xy *xy)
+{
+    long long lx = d->x, ly = d->y;
+    int x = d->x, y = d->y;
+
+    if (rotate) {
+	if (x >= ROT_MAX || x <= -ROT_MAX || y >= ROT_MAX || y <= -ROT_MAX) {
+	    x = (lx * rot_cos - ly * rot_sin) >> ROT_SHIFT;
+	    y = (lx * rot_sin + ly * rot_cos) >> ROT_SHIFT;
+	} else {
+	    x = (d->x * rot_cos - d->y * rot_sin) >> ROT_SHIFT;
+	    y = (d->x * rot_sin + d->y * rot_cos) >> ROT_SHIFT;
+	}
+    }
+
+    xy->x = (MAX_X / 2) + x;
+    xy->y = (MAX_Y / 2) - y;
+}
+
 static inline int project(const struct xy *pos, struct xy *xy)
 {
+    struct xy d;
     int clip = 0;
 
-    xy->x = (MAX_X / 2) + ((pos->x - gps_coord.xy.x) >> map_scale);
-    xy->y = (MAX_Y / 2) - ((pos->y - gps_coord.xy.y) >> map_scale);
+    offset(pos, &d);
+    turn(&d, xy);
 
     if (xy->x < 0 || xy->x >= MAX_X || xy->y < 0 || xy->y >= MAX_Y) {
 	clip = 0x4;
@@ -95,27 +170,56 @@ void draw_point(const struct xy *coord, const int shade)
 
 void draw_lines(const struct xy *pts, const int npts, const int shade)
 {
-    int i;
-    struct xy last_xy, cur_xy;
-    int cf, ct;
+    struct xy last, cur, last_xy, cur_xy;
+    int i, out_last, out, turned = 0;
 
     if (npts <= 1) return;
 
-    cf = project(&pts[0], &last_xy);
+    out_last = offset(&pts[0], &last);
     for (i = 1; i < npts; i++) {
 	if (pts[i-1].x == pts[i].x && pts[i-1].y == pts[i].y)
 	    continue;
 
-	ct = project(&pts[i], &cur_xy);
+	out = offset(&pts[i], &cur);
 
-	if (!cf || !ct || cf != cf)
+	/* only the points of lines that may cross the view are turned */
+	if (out & out_last)
+	    turned = 0;
+	else {
+	    if (!turned)
+		turn(&last, &last_xy);
+	    turn(&cur, &cur_xy);
 	    vfdlib_drawLineClipped(screen, last_xy.x, last_xy.y,
 				   cur_xy.x, cur_xy.y, shade);
-	last_xy = cur_xy;
-	cf = ct;
+	    last_xy = cur_xy;
+	    turned = 1;
+	}
+	last = cur;
+	out_last = out;
     }
 }
 
+/* the streets in the part of the map we're looking at, only the bigger roads
+ * when we're zoomed out */
+void draw_basemap(void)
+{
+    struct xy min, max, pts[BASEMAP_MAXPTS];
+    int n, class;
+
+    min.x = view.x - (view_hx << map_scale);
+    max.x = view.x + (view_hx << map_scale);
+    min.y = view.y - (view_hy << map_scale);
+    max.y = view.y + (view_hy << map_scale);
+
+    if (!basemap_begin(&min, &max, map_scale))
+	return;
+
+    /* side streets turn into a gray smear when there are 32m to a pixel */
+    while ((n = basemap_next(pts, &class)) > 0)
+	if (class != ROAD_LOCAL || map_scale < 5)
+	    draw_lines(pts, n, VFDSHADE_DIM);
+}
+
 #if 0 /* small 7x7 cursor */
 static unsigned char *cursors[] = {
     /*?*/  "\x00\x00\x07\x00\x07\x00\x10\x38\x6c\x38\x10\x00",
@@ -167,7 +271,8 @@ void draw_mark(const struct xy *pos, const int dir, const int shade)
 
     c = project(pos, &xy);
     if (!c)
-	_draw_mark(xy.x, xy.y, dir, shade);
+	_draw_mark(xy.x, xy.y, dir >= 0 ? (dir - rot_hdg + 360) % 360 : dir,
+		   shade);
 }
 
 void _draw_mark(const int x, const int y, const int dir, const int shade)
@@ -242,7 +347,7 @@ void draw_info(void)
     vfdlib_drawLineVertUnclipped(screen, MAX_X, 24, 8, VFDSHADE_MEDIUM);
 
     if (route_getwp(-1, NULL, &dist, NULL)) {
-	if (show_time) time_estimate(buf, dist);
+	if (show_time) time_estimate(buf, -1, dist);
 	else           formatdist(buf, dist);
 	vfdlib_drawText(screen, buf, VFD_WIDTH - vfdlib_getTextWidth(buf, 0)+1,
 			0, 0, -1);
@@ -257,12 +362,17 @@ void draw_info(void)
 	return;
     }
 
-    if (show_time) time_estimate(buf, dist);
+    if (show_time) time_estimate(buf, nextwp, dist);
     else	   formatdist(buf, dist);
     vfdlib_drawText(screen, buf, VFD_WIDTH - vfdlib_getTextWidth(buf, 0) + 1,
 		    VFD_HEIGHT + 1 - vfdlib_getTextHeight(0), 0, -1);
 
-    draw_popup(show_popups && (dist < 1000 || show_popups == 2) ? desc : NULL);
+    /* the instruction doesn't mean much when we're not on the route */
+    if (route_offroute())
+	draw_popup("Off route");
+    else
+	draw_popup(show_popups && (dist < 1000 || show_popups == 2) ? desc :
+		   NULL);
 
     /* draw pointer */
     b = radtodeg(bearing(&gps_coord.xy, &pos)) - gps_bearing;
@@ -316,8 +426,8 @@ void draw_wpstext(void)
     }
 
     lost = 0;
-    if (route_getwp(topwp, NULL, NULL, &desc)) {
-	int tmp = SHIFT + vfdlib_getTextWidth(desc, 0) - VFD_WIDTH;
+    if (route_getwp(topwp, NULL, NULL, NULL)) {
+	int tmp = SHIFT + route_getwidth(topwp, 0) - VFD_WIDTH;
 	if (tmp > lost) lost = tmp;
     }
 
@@ -340,7 +450,7 @@ void draw_wpstext(void)
 
 	vert = i * (h0 + 1) + 3 - voff;
 
-	if (show_time) time_estimate(buf, dist);
+	if (show_time) time_estimate(buf, topwp + i, dist);
 	else {
 	    if (i > 1 || (i == 1 && !voff)) {
 		vfdlib_drawText(screen, "+", 0, vert, 0, -1);
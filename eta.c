@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Arrival time estimates. Every leg of the route (from one waypoint to the
+ * next) is classified by the road it follows, and we keep an average speed
+ * for each class of road. We also remember how long each leg took on earlier
+ * drives of the same route, and prefer that over the class average.
+ *
+ * The time needed from every waypoint to the end of the route is kept as a
+ * fixed part (legs we have driven before) plus, per road class, the distance
+ * of the legs we haven't. That way a change in the average speeds doesn't
+ * require another pass over the route, and an estimate for any waypoint is
+ * only a couple of divisions.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gpsapp.h"
+
+enum { ETA_LOCAL = 0, ETA_HIGHWAY, ETA_RAMP, ETA_CLASSES };
+
+/* meters per hour, until we've seen how fast we actually go */
+static const int default_speed[ETA_CLASSES] = { 40000, 100000, 50000 };
+
+/* keywords in the waypoint description, matched case-insensitive */
+static const char *highway_words[] = {
+    "I-", "US-", "Interstate", "Hwy", "Highway", "Fwy", "Freeway", "Expy",
+    "Expressway", "Pkwy", "Parkway", "Tpke", "Turnpike", "Thruway", NULL
+};
+static const char *ramp_words[] = { "Ramp", "Exit", "Ext", NULL };
+
+#define SPEED_SHIFT 6	/* same weight as the old average vmg */
+#define ETA_SPEEDS "speeds"
+#define ETA_SYNC 300	/* seconds between writes, like TRACK_SYNC */
+
+struct eta_leg {
+    int class;		/* road class we drive on towards the next wp */
+    int time;		/* seconds it took last time, 0 if unknown */
+    int wpdist;		/* distance from this waypoint to the end */
+    int sfx_time;	/* known time from this waypoint to the end */
+    int sfx_dist[ETA_CLASSES]; /* distance left on legs of unknown time */
+};
+
+static struct eta_leg *legs;
+static int nlegs;
+static char eta_file[PATH_MAX];
+
+static int avgspeed[ETA_CLASSES]; /* << SPEED_SHIFT */
+
+/* leg we're currently driving, and when we started on it */
+#define LEG_NONE -2
+static int curleg = LEG_NONE;
+static int timing;
+static time_t leg_start;
+static time_t synced;	/* when we last wrote what we learned */
+
+static int has_word(const char *desc, const char **words)
+{
+    const char *p;
+    int i, len;
+
+    for (i = 0; words[i]; i++) {
+	len = strlen(words[i]);
+	for (p = desc; *p; p++)
+	    if (!strncasecmp(p, words[i], len))
+		return 1;
+    }
+    return 0;
+}
+
+static int eta_classify(const char *desc)
+{
+    if (!desc) return ETA_LOCAL;
+    if (has_word(desc, ramp_words)) return ETA_RAMP;
+    if (has_word(desc, highway_words)) return ETA_HIGHWAY;
+    return ETA_LOCAL;
+}
+
+static int class_speed(int class)
+{
+    return avgspeed[class] >> SPEED_SHIFT;
+}
+
+/* the one backward pass over the route, only needed when a leg time
+ * changes */
+static void eta_sums(void)
+{
+    int i, c, len;
+
+    for (i = nlegs - 1; i >= 0; i--) {
+	struct eta_leg *l = &legs[i];
+
+	if (i == nlegs - 1) {
+	    l->sfx_time = 0;
+	    memset(l->sfx_dist, 0, sizeof(l->sfx_dist));
+	    continue;
+	}
+
+	l->sfx_time = legs[i+1].sfx_time;
+	for (c = 0; c < ETA_CLASSES; c++)
+	    l->sfx_dist[c] = legs[i+1].sfx_dist[c];
+
+	len = l->wpdist - legs[i+1].wpdist;
+	if (l->time)
+	    l->sfx_time += l->time;
+	else
+	    l->sfx_dist[l->class] += len;
+    }
+}
+
+/* estimated seconds from waypoint i to the end of the route */
+static int eta_suffix(int i)
+{
+    int c, sec = legs[i].sfx_time;
+
+    for (c = 0; c < ETA_CLASSES; c++)
+	if (legs[i].sfx_dist[c] && class_speed(c))
+	    sec += ((unsigned long long)legs[i].sfx_dist[c] * 3600) /
+		   class_speed(c);
+    return sec;
+}
+
+static void eta_read_speeds(void)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int c, spd;
+
+    for (c = 0; c < ETA_CLASSES; c++)
+	avgspeed[c] = default_speed[c] << SPEED_SHIFT;
+
+    f = fopen(state_path(path, ETA_SPEEDS), "r");
+    if (!f) return;
+
+    for (c = 0; c < ETA_CLASSES; c++) {
+	if (fscanf(f, "%d", &spd) != 1) break;
+	if (spd > 0 && spd < 300000)
+	    avgspeed[c] = spd << SPEED_SHIFT;
+    }
+    fclose(f);
+}
+
+static void eta_write(void)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int i;
+
+    /* silently give up when the state directory isn't writable */
+    f = fopen(state_path(path, ETA_SPEEDS), "w");
+    if (f) {
+	fprintf(f, "%d %d %d\n", class_speed(ETA_LOCAL),
+		class_speed(ETA_HIGHWAY), class_speed(ETA_RAMP));
+	fclose(f);
+    }
+
+    if (!legs || !eta_file[0])
+	return;
+
+    f = fopen(eta_file, "w");
+    if (!f) return;
+
+    fprintf(f, "%d\n", nlegs);
+    for (i = 0; i < nlegs; i++)
+	if (legs[i].time)
+	    fprintf(f, "%d %d\n", i, legs[i].time);
+    /* the power may go away at any time in the car */
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+}
+
+static void eta_read_legs(void)
+{
+    FILE *f;
+    int n, leg, sec;
+
+    f = fopen(eta_file, "r");
+    if (!f) return;
+
+    /* the route file was changed since we've learned these */
+    if (fscanf(f, "%d", &n) != 1 || n != nlegs) {
+	fclose(f);
+	return;
+    }
+
+    while (fscanf(f, "%d %d", &leg, &sec) == 2)
+	if (leg >= 0 && leg < nlegs && sec > 0)
+	    legs[leg].time = sec;
+    fclose(f);
+}
+
+void eta_init(void)
+{
+    eta_read_speeds();
+}
+
+void eta_load(const char *name, const struct route *route)
+{
+    char buf[PATH_MAX];
+    int i;
+
+    eta_free();
+
+    if (!route->nwps)
+	return;
+
+    legs = calloc(route->nwps, sizeof(struct eta_leg));
+    if (!legs) return;
+    nlegs = route->nwps;
+
+    for (i = 0; i < nlegs; i++) {
+	legs[i].class = eta_classify(route->wps[i].short_desc);
+	legs[i].wpdist = route->dists[route->wps[i].idx];
+    }
+
+    /* routes that weren't loaded from a file have nothing to learn */
+    if (name) {
+	snprintf(buf, sizeof(buf), "%s.eta", name);
+	state_path(eta_file, buf);
+	eta_read_legs();
+    }
+    eta_sums();
+    synced = time(NULL);
+}
+
+void eta_free(void)
+{
+    if (legs) {
+	eta_write();
+	free(legs);
+    }
+    legs = NULL;
+    nlegs = 0;
+    eta_file[0] = '\0';
+    curleg = LEG_NONE;
+}
+
+/* the user is picking waypoints by hand, don't learn from this leg */
+void eta_skip(void)
+{
+    curleg = LEG_NONE;
+}
+
+/* called for every fix while we're moving along the route */
+void eta_update(const int nextwp, const unsigned int speed)
+{
+    int class, leg = nextwp - 1;
+    time_t now = time(NULL);
+
+    class = (legs && leg >= 0 && leg < nlegs) ? legs[leg].class : ETA_LOCAL;
+    avgspeed[class] += (int)speed - (avgspeed[class] >> SPEED_SHIFT);
+
+    if (leg == curleg)
+	return;
+
+    /* we drove all of the previous leg, remember how long it took */
+    if (timing && legs && curleg >= 0 && leg == curleg + 1 && now > leg_start) {
+	int sec = now - leg_start;
+	struct eta_leg *l = &legs[curleg];
+
+	/* written out at most every ETA_SYNC seconds, and by eta_free when
+	 * we switch routes or exit, so that we don't spin up the disk for
+	 * every short leg but don't lose the drive when the power goes */
+	l->time = l->time ? (l->time + sec) / 2 : sec;
+	eta_sums();
+	if (now >= synced + ETA_SYNC) {
+	    eta_write();
+	    synced = now;
+	}
+    }
+
+    /* only time legs we enter at the beginning */
+    timing = (curleg != LEG_NONE && leg == curleg + 1);
+    curleg = leg;
+    leg_start = now;
+}
+
+/* estimated number of seconds to reach waypoint wp at distance dist, -1 when
+ * we don't know */
+int eta_seconds(const int wp, const unsigned int dist)
+{
+    int next = nextwp, i = wp, class, togo, sec;
+
+    if (!dist) return 0;
+
+    class = (legs && next > 0 && next <= nlegs) ? legs[next-1].class
+						: ETA_LOCAL;
+    if (!class_speed(class)) return -1;
+
+    if (i == -1) i = nlegs - 1;
+
+    if (!legs || i < next || i >= nlegs || next >= nlegs)
+	return ((unsigned long long)dist * 3600) / class_speed(class);
+
+    /* part of dist that is left on the leg we're driving now */
+    togo = dist - (legs[next].wpdist - legs[i].wpdist);
+    if (togo < 0) togo = 0;
+
+    sec = ((unsigned long long)togo * 3600) / class_speed(class);
+    return sec + eta_suffix(next) - eta_suffix(i);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Constant velocity alpha-beta filter over the projected position. It is fed
+ * with every fix and, when there is one, the velocity reported by the
+ * receiver, and lets the map extrapolate our position between fixes. The
+ * heading is derived from the filtered velocity, and follows the
+ * measurements more slowly when we're moving slowly and the receiver's
+ * bearing becomes unreliable.
+ */
+
+#include <sys/time.h>
+#include <math.h>
+#include "gpsapp.h"
+
+#define ALPHA 0.75	   /* how much we trust a new position */
+#define BETA  0.2	   /* velocity correction from the position residual */
+#define GAMMA 0.5	   /* how much we trust the reported velocity */
+
+#define MAX_PREDICT 2.0	   /* don't extrapolate for more than 2 seconds */
+#define MIN_HEADING_SPD 0.3   /* m/s, below this we keep the last heading */
+#define FULL_HEADING_SPD 2.0  /* m/s, above this the heading isn't damped */
+
+static int valid;
+static struct timeval stamp;	/* time of the last fix */
+static double x, y;		/* meters */
+static double vx, vy;		/* meters per second */
+static double heading = -1.0;	/* degrees */
+
+static double timediff(const struct timeval *a, const struct timeval *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec) / 1000000.0;
+}
+
+void filter_reset(void)
+{
+    valid = 0;
+}
+
+/* have_vel is 0 when the receiver didn't report a velocity with this fix,
+ * ve and vn are meaningless then */
+void filter_fix(const struct xy *pos, int have_vel, double ve, double vn,
+		const struct timeval *when)
+{
+    double dt, px, py, rx, ry, spd, hdg, turn, w;
+
+    dt = timediff(when, &stamp);
+
+    if (!valid || dt <= 0.0 || dt > 10.0) {
+	/* start over */
+	x = pos->x; y = pos->y;
+	vx = have_vel ? ve : 0.0;
+	vy = have_vel ? vn : 0.0;
+	valid = 1;
+    } else {
+	px = x + vx * dt;
+	py = y + vy * dt;
+	rx = pos->x - px;
+	ry = pos->y - py;
+
+	x = px + ALPHA * rx;
+	y = py + ALPHA * ry;
+	vx += (BETA / dt) * rx;
+	vy += (BETA / dt) * ry;
+	if (have_vel) {
+	    vx += GAMMA * (ve - vx);
+	    vy += GAMMA * (vn - vy);
+	}
+    }
+    stamp = *when;
+
+    spd = sqrt(vx * vx + vy * vy);
+    if (spd < MIN_HEADING_SPD)
+	return;
+
+    hdg = radtodeg(atan2(vx, vy));
+    if (hdg < 0.0) hdg += 360.0;
+
+    if (heading < 0.0) {
+	heading = hdg;
+	return;
+    }
+
+    /* damp heading changes when we're barely moving */
+    w = spd >= FULL_HEADING_SPD ? 1.0 : spd / FULL_HEADING_SPD;
+    turn = hdg - heading;
+    if (turn < -180.0) turn += 360.0;
+    if (turn >= 180.0) turn -= 360.0;
+    heading += w * turn;
+    if (heading < 0.0)    heading += 360.0;
+    if (heading >= 360.0) heading -= 360.0;
+}
+
+/* where we expect to be right now, returns 0 if we have no idea */
+int filter_predict(struct xy *pos, const struct timeval *now)
+{
+    double dt;
+
+    if (!valid) return 0;
+
+    dt = timediff(now, &stamp);
+    if (dt < 0.0) dt = 0.0;
+    if (dt > MAX_PREDICT) dt = MAX_PREDICT;
+
+    pos->x = x + vx * dt;
+    pos->y = y + vy * dt;
+    return 1;
+}
+
+/* whether it is worth redrawing the map between fixes */
+int filter_moving(const struct timeval *now)
+{
+    if (!valid || vx * vx + vy * vy < MIN_HEADING_SPD * MIN_HEADING_SPD)
+	return 0;
+    return timediff(now, &stamp) < MAX_PREDICT;
+}
+
+/* filtered speed in meters per hour */
+unsigned int filter_speed(void)
+{
+    if (!valid) return 0;
+    return sqrt(vx * vx + vy * vy) * 3600.0;
+}
+
+/* filtered heading in degrees, -1 if unknown */
+int filter_heading(void)
+{
+    if (heading < 0.0) return -1;
+    return (int)(heading + 0.5) % 360;
+}
@@ -136,7 +136,7 @@ static void em_decode(struct gps_state *gps)
         return;
     }
 
-    draw_activity(0);
+    serial_activity();
 
     /* verify checksum XXX */
 
@@ -189,7 +189,31 @@ restart:
 	goto restart;
 }
 
-REGISTER_PROTOCOL("EARTHMATE", 9600, 'N', NULL, NULL, em_update);
+/* count the message headers with a valid sync word and header checksum */
+static int em_sniff(const unsigned char *buf, int len)
+{
+    unsigned short h[5];
+    int i, j, score = 0;
+
+    for (i = 0; i + 10 <= len; i++) {
+	if (buf[i] == 'E' && i + 6 <= len && memcmp(&buf[i], "EARTHA", 6) == 0) {
+	    score++;
+	    continue;
+	}
+	if (buf[i] != ETX || buf[i+1] != DLE)
+	    continue;
+
+	for (j = 0; j < 5; j++)
+	    h[j] = INT16((unsigned char *)&buf[i + WD(j)]);
+	if (zodiac_checksum(h, 4) == h[4]) {
+	    score++;
+	    i += 9;
+	}
+    }
+    return score;
+}
+
+REGISTER_PROTOCOL("EARTHMATE", 9600, 'N', NULL, NULL, em_update, em_sniff);
 
 void zodiac_send(int type, unsigned short *dat, int dlen)
 {
@@ -89,7 +89,7 @@ static void garmin_r33pvt_data(struct gps_state *gps)
 
 static void garmin_decode(struct gps_state *gps)
 {
-    draw_activity(0);
+    serial_activity();
 
     if (packet[0] == PVT)
 	garmin_r33pvt_data(gps);
@@ -153,5 +153,6 @@ restart:
 	goto restart;
 }
 
-REGISTER_PROTOCOL("GARMIN", 9600, 'N', garmin_init, NULL, garmin_update);
+/* the receiver is silent until garmin_init asked it to send PVT data */
+REGISTER_PROTOCOL("GARMIN", 9600, 'N', garmin_init, NULL, garmin_update, NULL);
 
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Decodes the reports gpsd sends in watcher mode, lines of the form
+ * "GPSD,O=RMC 1034612540.00 0.005 40.449754 -79.926868 329.40 7.20 ? 244.4 13.9 0.000 ? ? ? 3"
+ * "GPSD,Y=GSV 1034612540.00 3:23 6 84 40 1:28 7 30 35 0:31 40 150 42 1:"
+ * Only the receiver thread talks to gpsd, see serial.c.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gpsapp.h"
+#include "gps_protocol.h"
+
+#define MAX_REPORT_SIZE 512
+#define MAX_FIELDS 16
+
+static char report[MAX_REPORT_SIZE];
+static int report_idx;
+
+/* split p into whitespace separated fields, '?' fields are left as NULL */
+static int gpsd_fields(char *p, char **fields)
+{
+    int n = 0;
+
+    while (*p && n < MAX_FIELDS) {
+	while (*p == ' ') *p++ = '\0';
+	if (!*p) break;
+
+	fields[n++] = (*p == '?') ? NULL : p;
+	while (*p && *p != ' ') p++;
+    }
+    return n;
+}
+
+/* O=tag time ept lat lon alt eph epv track speed climb epd eps epc mode */
+static void gpsd_O(char *p, struct gps_state *gps)
+{
+    char *f[MAX_FIELDS];
+    double b, spd;
+    int n, fix;
+
+    /* "O=?" means that gpsd has no fix */
+    n = gpsd_fields(p, f);
+    if (n < 15 || !f[3] || !f[4]) {
+	if (gps->fix) {
+	    gps->fix = 0;
+	    gps->updated |= GPS_STATE_FIX;
+	}
+	return;
+    }
+
+    if (f[1]) gps->time = strtod(f[1], NULL);
+
+    fix = f[14] ? atoi(f[14]) : 2;
+    fix = (fix == 3) ? 0x3 : (fix == 2) ? 0x1 : 0;
+    if (fix != gps->fix) {
+	gps->fix = fix;
+	gps->updated |= GPS_STATE_FIX;
+    }
+
+    gps->lat = degtorad(strtod(f[3], NULL));
+    gps->lon = degtorad(strtod(f[4], NULL));
+    gps->updated |= GPS_STATE_COORD;
+
+    if (f[5]) gps->alt = strtod(f[5], NULL);
+
+    if (f[8]) {
+	gps->bearing = (int)strtod(f[8], NULL);
+	gps->updated |= GPS_STATE_BEARING;
+    }
+
+    if (f[9]) {
+	b = degtorad(gps->bearing);
+	spd = strtod(f[9], NULL);
+	gps->spd_east  = sin(b) * spd;
+	gps->spd_north = cos(b) * spd;
+	gps->spd_up    = f[10] ? strtod(f[10], NULL) : 0.0;
+	gps->updated |= GPS_STATE_SPEED;
+    }
+}
+
+/* Y=tag time nsats:prn elv azm ss used:... */
+static void gpsd_Y(char *p, struct gps_state *gps)
+{
+    char *f[MAX_FIELDS], *next;
+    int i, n;
+
+    p = strchr(p, ':');
+    if (!p) return;
+
+    for (i = 0; i < MAX_TRACKED_SATS; i++)
+	gps->sats[i].used = 0;
+
+    for (p++; *p; p = next) {
+	next = strchr(p, ':');
+	if (next) *next++ = '\0';
+	else next = p + strlen(p);
+
+	n = gpsd_fields(p, f);
+	if (n < 5 || !f[0]) continue;
+
+	new_sat(gps, atoi(f[0]), gps->time,
+		f[1] ? degtorad(atoi(f[1])) : UNKNOWN_ELV,
+		f[2] ? degtorad(atoi(f[2])) : UNKNOWN_AZM,
+		f[3] ? atoi(f[3]) / 4 : UNKNOWN_SNR,
+		f[4] ? atoi(f[4]) : UNKNOWN_USED);
+    }
+    gps->updated |= GPS_STATE_SIGNALS | GPS_STATE_SATS;
+}
+
+/* Q=nsats pdop hdop vdop tdop gdop */
+static void gpsd_Q(char *p, struct gps_state *gps)
+{
+    char *f[MAX_FIELDS];
+
+    if (gpsd_fields(p, f) >= 3 && f[2])
+	gps->hdop = strtod(f[2], NULL);
+}
+
+static void gpsd_decode(struct gps_state *gps)
+{
+    char *p, *next;
+
+    if (memcmp(report, "GPSD,", 5) != 0)
+	return;
+
+    serial_activity();
+
+    /* a report can contain several comma separated responses */
+    for (p = &report[5]; *p; p = next) {
+	next = strchr(p, ',');
+	if (next) *next++ = '\0';
+	else next = p + strlen(p);
+
+	if (p[0] == '\0' || p[1] != '=')
+	    continue;
+
+	switch (p[0]) {
+	case 'O': gpsd_O(&p[2], gps); break;
+	case 'Y': gpsd_Y(&p[2], gps); break;
+	case 'Q': gpsd_Q(&p[2], gps); break;
+	}
+    }
+}
+
+static void gpsd_init(void)
+{
+    report_idx = 0;
+}
+
+static void gpsd_update(char c, struct gps_state *gps)
+{
+    if (c == '\r') return;
+
+    if (c == '\n') {
+	report[report_idx] = '\0';
+	gpsd_decode(gps);
+	report_idx = 0;
+	return;
+    }
+
+    report[report_idx++] = c;
+
+    /* discard long lines */
+    if (report_idx == MAX_REPORT_SIZE)
+	report_idx = 0;
+}
+
+/* not registered with the serial protocols, serial.c uses it directly for
+ * data coming from gpsd */
+struct gps_protocol gpsd_protocol = {
+    .name = "GPSD",
+    .init = gpsd_init,
+    .update = gpsd_update,
+};
@@ -10,6 +10,7 @@
 #include <math.h>
 #include "gpsapp.h"
 #include "gps_protocol.h"
+#include "metrics.h"
 
 static int datestamp;
 
@@ -18,8 +19,10 @@ static time_t today(void)
     /* Some gps's don't give us any NMEA sentences with a date, we can try
      * to compensate by pulling the date off of the local clock... */
     time_t now = time(NULL);
-    struct tm *tm = gmtime(&now);
-    return conv_date(tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday);
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    return conv_date(tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
 }
 
 static int hex(char c)
@@ -167,7 +170,7 @@ void nmea_decode(struct gps_state *gps)
     fprintf(stderr, "%s\n", packet);
 #endif
 
-    draw_activity(0);
+    serial_activity();
 
     p = &packet[6];
 
@@ -370,17 +373,25 @@ static void nmea_update(char c, struct gps_state *gps)
 	    /* recognize tripmate's 'ASTRAL' message */
 	    if (packet_idx >= 6 && memcmp(packet, "ASTRAL", 6) == 0)
 		serial_send("$IIGPQ,ASTRAL*73\r\n", 18);
+	    else if (packet_idx)
+		METRIC_COUNT(C_DROPPED);
 	    goto restart;
 	}
 
 	/* and end with '*XX' */
 	n = strlen(packet);
-	if (n < 9 || packet[n-3] != '*') goto restart;
+	if (n < 9 || packet[n-3] != '*') {
+	    METRIC_COUNT(C_DROPPED);
+	    goto restart;
+	}
 
 	/* fix up the xor and check the trailing checksum */
 	xor ^= '$' ^ '*' ^ packet[n-2] ^ packet[n-1];
 	csum = hex(packet[n-2]) << 4 | hex(packet[n-1]);
-	if (xor != csum) goto restart;
+	if (xor != csum) {
+	    METRIC_COUNT(C_CHECKSUM);
+	    goto restart;
+	}
 
 	nmea_decode(gps);
 
@@ -395,27 +406,29 @@ restart:
     xor ^= c;
 
     /* discard long lines */
-    if (packet_idx == MAX_PACKET_SIZE)
+    if (packet_idx == MAX_PACKET_SIZE) {
+	METRIC_COUNT(C_DROPPED);
 	goto restart;
+    }
 }
 
 static void nmea_init(void)
 {
   char buf[40];
   time_t t;
-  struct tm *tm;
+  struct tm tm;
   unsigned short *dat;
 
   t = time(NULL);
-  tm = gmtime(&t);
+  gmtime_r(&t, &tm);
 
   serial_send("$PMOTG,GGA,0001\r\n", 17);
   serial_send("$PMOTG,RMC,0001\r\n", 17);
   serial_send("$PMOTG,GSA,0001\r\n", 17);
   serial_send("$PMOTG,GSV,0001\r\n", 17);
   snprintf(buf, 40, "$PRWIINIT,V,,,,,,,,,,,,%02d%02d%02d,%02d%02d%02d\r\n",
-	  tm->tm_hour, tm->tm_min, tm->tm_sec,
-	  tm->tm_mday, tm->tm_mon + 1, tm->tm_year);
+	  tm.tm_hour, tm.tm_min, tm.tm_sec,
+	  tm.tm_mday, tm.tm_mon + 1, tm.tm_year);
   serial_send(buf, 38);
 
   if (do_coldstart==0) {
@@ -433,5 +446,97 @@ static void nmea_init(void)
   }
 }
 
-REGISTER_PROTOCOL("NMEA", 4800, 'N', nmea_init, NULL, nmea_update);
+/* count the sentences with a valid checksum */
+static int nmea_sniff(const unsigned char *buf, int len)
+{
+    int i, start = -1, score = 0;
+    char xor = '\0';
+
+    for (i = 0; i < len; i++) {
+	if (buf[i] == '$') {
+	    start = i;
+	    xor = '\0';
+	}
+	else if (start == -1)
+	    continue;
+	else if (buf[i] == '*') {
+	    if (i + 2 < len && i - start < MAX_PACKET_SIZE &&
+		(hex(buf[i+1]) << 4 | hex(buf[i+2])) == xor)
+		score++;
+	    start = -1;
+	}
+	else
+	    xor ^= buf[i];
+    }
+    return score;
+}
+
+REGISTER_PROTOCOL("NMEA", 4800, 'N', nmea_init, NULL, nmea_update, nmea_sniff);
+
+/* add the checksum and line termination to a '$...' sentence in buf */
+static int nmea_finish(char *buf, int len)
+{
+    char xor = '\0';
+    int i;
+
+    for (i = 1; i < len; i++)
+	xor ^= buf[i];
+    return len + sprintf(buf + len, "*%02X\r\n", (unsigned char)xor);
+}
+
+/* ddmm.mmmm,N */
+static int nmea_format_latlong(char *buf, double rad, int degdigits, char pos,
+			       char neg)
+{
+    double deg = fabs(radtodeg(rad));
+    int d = deg;
+
+    return sprintf(buf, "%0*d%07.4f,%c", degdigits, d, (deg - d) * 60.0,
+		   rad < 0 ? neg : pos);
+}
+
+/* The next two synthesize sentences from our current state, for instance to
+ * relay data from receivers that don't talk NMEA. buf should be at least
+ * NMEA_MAX_SENTENCE characters. */
+int nmea_rmc(char *buf, struct gps_state *gps)
+{
+    time_t t = gps->time;
+    struct tm tm;
+    double knots;
+    int len;
+
+    gmtime_r(&t, &tm);
+    knots = sqrt(gps->spd_east * gps->spd_east +
+		 gps->spd_north * gps->spd_north) * 1.943844;
+
+    len = sprintf(buf, "$GPRMC,%02d%02d%02d,%c,", tm.tm_hour, tm.tm_min,
+		  tm.tm_sec, gps->fix & 0x1 ? 'A' : 'V');
+    len += nmea_format_latlong(buf + len, gps->lat, 2, 'N', 'S');
+    buf[len++] = ',';
+    len += nmea_format_latlong(buf + len, gps->lon, 3, 'E', 'W');
+    len += sprintf(buf + len, ",%.1f,%d,%02d%02d%02d,,", knots, gps->bearing,
+		   tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+    return nmea_finish(buf, len);
+}
+
+int nmea_gga(char *buf, struct gps_state *gps)
+{
+    time_t t = gps->time;
+    struct tm tm;
+    int i, len, nsats = 0;
+
+    gmtime_r(&t, &tm);
+    for (i = 0; i < MAX_TRACKED_SATS; i++)
+	if (gps->sats[i].svn && gps->sats[i].used > 0)
+	    nsats++;
+
+    len = sprintf(buf, "$GPGGA,%02d%02d%02d,", tm.tm_hour, tm.tm_min,
+		  tm.tm_sec);
+    len += nmea_format_latlong(buf + len, gps->lat, 2, 'N', 'S');
+    buf[len++] = ',';
+    len += nmea_format_latlong(buf + len, gps->lon, 3, 'E', 'W');
+    len += sprintf(buf + len, ",%d,%02d,%.1f,%.1f,M,,M,,", gps->fix & 0x1,
+		   nsats, gps->hdop < 100.0 ? gps->hdop : 99.9, gps->alt);
+    return nmea_finish(buf, len);
+}
 
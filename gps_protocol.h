@@ -7,6 +7,7 @@
 #ifndef _GPS_PROTOCOL_H_
 #define _GPS_PROTOCOL_H_
 
+#include <sys/time.h>
 #include <time.h>
 
 /* shared scratch buffer that can be used by the various decoding protocols
@@ -15,6 +16,7 @@
 extern unsigned char packet[MAX_PACKET_SIZE];
 extern int packet_idx;
 void serial_send(char *buf, int len);
+void serial_activity(void);
 
 /* structure to be filled in by the decoding protocols */
 #define MAX_TRACKED_SATS 8
@@ -39,6 +41,9 @@ struct gps_state {
     time_t  time;	/* GPS time, most likely of last fix, translated to
 			   unix time */
 
+    unsigned int seq;	     /* incremented for every update we publish */
+    struct timeval stamp;    /* when the data of this update was read */
+
     int	    fix;	/* type of last fix (0 = No fix, 2 = 2D, 3 = 3D) */
     double  hdop;	/* horizontal dillution of precision */
 
@@ -62,6 +67,9 @@ struct gps_protocol {
     void (*init)(void); /* protocol initializer */
     void (*poll)(void); /* every 5 seconds to poll non-automatic updates */
     void (*update)(char c, struct gps_state *state); /* serial input */
+    int (*sniff)(const unsigned char *buf, int len); /* autodetection, returns
+							the number of correctly
+							framed packets */
 };
 
 /* helper functions in gps_protocol.c */
@@ -76,8 +84,16 @@ int conv_date(int year, int mon, int day);
 
 extern struct gps_protocol *gps_protocols;
 
-#define REGISTER_PROTOCOL(proto_name, serial_baud, serial_parity, initfunc, pollfunc, updatefunc) \
-  static struct gps_protocol __this = { .name = proto_name, .baud = serial_baud, .parity = serial_parity, .init = initfunc, .poll = pollfunc, .update = updatefunc }; \
+/* sentences synthesized from the gps state (gps_nmea.c) */
+#define NMEA_MAX_SENTENCE 96
+int nmea_rmc(char *buf, struct gps_state *gps);
+int nmea_gga(char *buf, struct gps_state *gps);
+
+/* decoder for gpsd's watcher mode reports (gps_gpsd.c) */
+extern struct gps_protocol gpsd_protocol;
+
+#define REGISTER_PROTOCOL(proto_name, serial_baud, serial_parity, initfunc, pollfunc, updatefunc, snifffunc) \
+  static struct gps_protocol __this = { .name = proto_name, .baud = serial_baud, .parity = serial_parity, .init = initfunc, .poll = pollfunc, .update = updatefunc, .sniff = snifffunc }; \
   static __attribute__((constructor)) void ___init(void) { __this.next = gps_protocols; gps_protocols = &__this; }
 
 /* automatic destructors don't work right on the arm, or did I mess this up?? */
@@ -15,7 +15,7 @@ static void taip_decode(struct gps_state *gps)
     char buf[10];
     double speed, b;
 
-    draw_activity(0);
+    serial_activity();
 
     if (strcmp(packet, "RTM") == 0) {
 	// datestamp = ???
@@ -95,5 +95,22 @@ restart:
 	goto restart;
 }
 
-REGISTER_PROTOCOL("TAIP", 4800, 'N', taip_init, NULL, taip_update);
+/* count the >R...< response messages */
+static int taip_sniff(const unsigned char *buf, int len)
+{
+    int i, start = -1, score = 0;
+
+    for (i = 0; i < len; i++) {
+	if (buf[i] == '>')
+	    start = i;
+	else if (buf[i] == '<' && start != -1) {
+	    if (buf[start+1] == 'R' && i - start < MAX_PACKET_SIZE)
+		score++;
+	    start = -1;
+	}
+    }
+    return score;
+}
+
+REGISTER_PROTOCOL("TAIP", 4800, 'N', taip_init, NULL, taip_update, taip_sniff);
 
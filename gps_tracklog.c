@@ -23,6 +23,7 @@ struct state {
 
 static struct state prev;
 static FILE *track;
+static int restarted;	/* pick up the time where we left off */
 
 static int tracklog_read(struct state *pos)
 {
@@ -55,13 +56,16 @@ void tracklog_init(void)
     serialfd = fileno(track);
     //if (tracklog_read(&prev) == 2) rewind(track);
 
-    gps_state.time = prev.time;
+    /* we run in the receiver thread, the time is set in the receiver's
+     * state when the first update comes in */
+    restarted = 1;
 }
 
 extern void nmea_decode(struct gps_state *gps);
 void tracklog_update(char c, struct gps_state *gps)
 {
     struct state cur;
+    struct coord pos;
     long offset;
     double ratio, dlat, dlon;
     static struct xy last;
@@ -69,6 +73,10 @@ void tracklog_update(char c, struct gps_state *gps)
     //static int ms;
     //if ((ms++ % 10) != 0) return;
 
+    if (restarted) {
+	gps->time = prev.time;
+	restarted = 0;
+    }
     gps->time++;
 
 next:
@@ -93,25 +101,26 @@ next:
     gps->lon = degtorad(dlon * ratio + prev.lon);
     gps->updated |= GPS_STATE_COORD;
 
-    gps_coord.lat = gps->lat;
-    gps_coord.lon = gps->lon;
-    toTM(&gps_coord);
+    /* we run in the receiver thread, so don't touch gps_coord */
+    pos.lat = gps->lat;
+    pos.lon = gps->lon;
+    toTM(&pos);
 
     gps->bearing = radtodeg(atan2(dlon, dlat));
     if (gps->bearing < 0) gps->bearing += 360;
     gps->updated |= GPS_STATE_BEARING;
 
-    gps->spd_east  = gps_coord.xy.x - last.x;
-    gps->spd_north = gps_coord.xy.y - last.y;
+    gps->spd_east  = pos.xy.x - last.x;
+    gps->spd_north = pos.xy.y - last.y;
     gps->spd_up    = 0;
 
     if (abs(gps->spd_east)  > 1e6) gps->spd_east = 0;
     if (abs(gps->spd_north) > 1e6) gps->spd_north = 0;
     gps->updated |= GPS_STATE_SPEED;
 
-    last = gps_coord.xy;
+    last = pos.xy;
     fseek(track, offset, SEEK_SET);
 }
 
-REGISTER_PROTOCOL("TRACKLOG", 0, 'N', tracklog_init, NULL, tracklog_update);
+REGISTER_PROTOCOL("TRACKLOG", 0, 'N', tracklog_init, NULL, tracklog_update, NULL);
 
@@ -324,7 +324,7 @@ static void tsip_decode(struct gps_state *gps)
     fprintf(stderr, "receiving %x\n", packet[0]);
 #endif
 
-    draw_activity(0);
+    serial_activity();
 
     switch(packet[0]) {
     case 0x41: tsip_41_time(); break;
@@ -409,5 +409,39 @@ restart:
 	goto restart;
 }
 
-REGISTER_PROTOCOL("TSIP", 9600, 'O', tsip_init, tsip_poll, tsip_update);
+/* count the <dle>id...<dle><etx> framed packets with a report id we know */
+static int tsip_sniff(const unsigned char *buf, int len)
+{
+    static const unsigned char reports[] = {
+	0x41, 0x42, 0x43, 0x45, 0x46, 0x47, 0x4A, 0x4B, 0x55, 0x56, 0x57,
+	0x5C, 0x6D, 0x82, 0x83, 0x84, 0x8F
+    };
+    int i, n = -1, score = 0;
+    unsigned char id = 0;
+
+    for (i = 0; i + 1 < len; i++) {
+	if (buf[i] != DLE) {
+	    if (n >= 0) n++;
+	    continue;
+	}
+
+	if (buf[i+1] == DLE) { /* escaped <dle> */
+	    if (n >= 0) n++;
+	    i++;
+	}
+	else if (buf[i+1] == ETX) {
+	    if (n >= 0 && n < MAX_PACKET_SIZE && memchr(reports, id, sizeof(reports)))
+		score++;
+	    n = -1;
+	    i++;
+	}
+	else { /* start of a packet */
+	    id = buf[++i];
+	    n = 0;
+	}
+    }
+    return score;
+}
+
+REGISTER_PROTOCOL("TSIP", 9600, 'O', tsip_init, tsip_poll, tsip_update, tsip_sniff);
 
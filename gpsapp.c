@@ -5,20 +5,25 @@
  */
 
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 #include "empeg_ui.h"
 #include "vfdlib.h"
 #include "gpsapp.h"
+#include "metrics.h"
 
 enum {
     VIEW_SATS = 0,
     VIEW_MAP,
     VIEW_ROUTE,
-} visual;
+};
+int visual;
 int show_metric     = 0;
 int show_gpscoords  = 0;
 int coord_format    = 0;
@@ -28,6 +33,9 @@ int show_scale      = 1;
 int show_popups     = 1;
 int show_time	    = 0;
 int do_coldstart    = 0;
+int framerate	    = 4; /* map redraws per second while moving */
+int heading_up	    = 0;
+int auto_reroute    = 0;
 
 /* height of font 0, used a lot, so looking it up once might be useful */
 int h0;
@@ -42,6 +50,7 @@ static int menu_pos;
 static int lastmenu_pos;
 static char *menu_msg[] = {
     "Load Route",
+    "Reroute",
     "Toggle Text/Map/Sats",
     "Toggle Popups",
     "Toggle Miles/Meters",
@@ -49,14 +58,32 @@ static char *menu_msg[] = {
     "Toggle Distance/Time",
     "Toggle Track",
     "Toggle DDD/DMM/DMS",
+    "Toggle North/Heading Up",
 };
-#define MENU_ENTRIES 8
+#define MENU_ENTRIES 10
+
+#define MAX_FRAMERATE 25
+#define CONFIG_FILE "empeg/var/config.ini"
+#define SETTINGS_FILE "settings" /* in statedir */
 
 int get_visual()
 {
     return (int)visual;
 }
 
+/* things we learn while driving are kept here, when it is writable */
+#define STATE_DIR "empeg/var/gpsapp"
+char *statedir = NULL;
+
+char *state_path(char *buf, const char *name)
+{
+    const char *dir = statedir ? statedir : STATE_DIR;
+
+    mkdir(dir, 0755);
+    snprintf(buf, PATH_MAX, "%s/%s", dir, name);
+    return buf;
+}
+
 void timesub(struct timeval *res, struct timeval *from, struct timeval *val)
 {
     res->tv_sec  = from->tv_sec  - val->tv_sec;
@@ -67,11 +94,85 @@ void timesub(struct timeval *res, struct timeval *from, struct timeval *val)
     }
 }
 
+static int config_protocol(const struct config_option *opt, char *value)
+{
+    serial_protocol(value);
+    return 0;
+}
+
+static const struct config_option options[] = {
+    { "protocol",     config_protocol, NULL,	    0, CONFIG_STARTUP },
+    { "serialport",   config_string, &serport,	    0, CONFIG_STARTUP },
+    { "baud",	      config_int,    &serbaud, 115200, CONFIG_STARTUP },
+    { "relay",	      config_string, &relayaddr,    0, CONFIG_STARTUP },
+    { "tracklog",     config_string, &trackfile,    0, CONFIG_STARTUP },
+    { "basemap",      config_string, &basemapfile,  0, CONFIG_STARTUP },
+    { "tilecache",    config_int,    &tilecache_size, 16384 },
+    { "graph",	      config_string, &graphfile,    0, CONFIG_STARTUP },
+    { "reroute",      config_choice, &auto_reroute, 1 },
+    { "coldstart",    config_choice, &do_coldstart, 1, CONFIG_STARTUP },
+    { "routedir",     config_string, &routedir },
+    { "statedir",     config_string, &statedir },
+    { "visual",	      config_choice, &visual,	     2, CONFIG_MENU },
+    { "metric",	      config_choice, &show_metric,   1, CONFIG_MENU },
+    { "gpscoords",    config_choice, &show_gpscoords, 1, CONFIG_MENU },
+    { "coord_format", config_choice, &coord_format,  2, CONFIG_MENU },
+    { "track",	      config_choice, &show_track,    1, CONFIG_MENU },
+    { "scale",	      config_choice, &show_scale,    1 },
+    { "popups",	      config_choice, &show_popups,   2, CONFIG_MENU },
+    { "time",	      config_choice, &show_time,     1, CONFIG_MENU },
+    { "framerate",    config_int,    &framerate, MAX_FRAMERATE },
+    { "headingup",    config_choice, &heading_up,    1, CONFIG_MENU },
+    { NULL }
+};
+
+/* the settings changed from the menu override config.ini, unless config.ini
+ * was edited after they were saved */
+static void load_settings(void)
+{
+    char path[PATH_MAX];
+    struct stat cfg, st;
+
+    config_read(CONFIG_FILE, options, 0);
+    config_watch(CONFIG_FILE);
+
+    state_path(path, SETTINGS_FILE);
+    if (stat(path, &st) == 0 &&
+	(stat(CONFIG_FILE, &cfg) == -1 || st.st_mtime >= cfg.st_mtime))
+	config_read(path, options, 0);
+}
+
+static void save_settings(void)
+{
+    char path[PATH_MAX];
+
+    config_save(state_path(path, SETTINGS_FILE), options);
+}
+
+/* config.ini was changed while we're running */
+static void reload_settings(void)
+{
+    config_read(CONFIG_FILE, options, 1);
+    routes_stale();
+    do_refresh = 1;
+}
+
+/* we left the route, or got back on it */
+static void offroute_changed(int off)
+{
+    if (off && auto_reroute)
+	router_start();
+    do_refresh = 1;
+}
+
 static void refresh_display(void)
 {
-    struct xy pos;
+    struct timeval now, render, push;
+    struct xy pos, cur;
     int i;
 
+    METRIC_START(render);
+    METRIC_COUNT(C_REFRESH);
     do_refresh = 0;
 
     draw_clear();
@@ -92,14 +193,23 @@ static void refresh_display(void)
 	if (show_gpscoords)
 	    draw_gpscoords();
 
+	/* extrapolate where we are since the last fix */
+	gettimeofday(&now, NULL);
+	if (!framerate || !filter_predict(&cur, &now))
+	    cur = gps_coord.xy;
+	draw_setview(&cur);
+
 	vfdlib_setClipArea(0, 0, VFD_WIDTH - VFD_HEIGHT, VFD_HEIGHT);
 
+	/* streets underneath everything else */
+	draw_basemap();
+
 	/* draw tracklog */
 	if (show_track)
 	    track_draw();
 
 	/* draw route we're following */
-	route_draw(&gps_coord.xy);
+	route_draw(&cur);
 
 	/* highlight waypoints */
 	i = 0;
@@ -112,14 +222,20 @@ static void refresh_display(void)
 	}
 
 	/* draw our own location */
-	draw_mark(&gps_coord.xy, gps_bearing, VFDSHADE_BRIGHT);
+	draw_mark(&cur, gps_bearing, VFDSHADE_BRIGHT);
 
 	vfdlib_setClipArea(0, 0, VFD_WIDTH, VFD_HEIGHT);
 	draw_info();
 	break;
 
     case VIEW_ROUTE:
-	draw_wpstext();
+	i = route_loading();
+	if (i != -1) {
+	    char buf[20];
+	    sprintf(buf, "Loading route %d%%", i);
+	    draw_msg(buf);
+	} else
+	    draw_wpstext();
 	break;
     }
 
@@ -132,40 +248,35 @@ static void refresh_display(void)
 	char *msg=NULL;
 	lastmenu--;
 	switch(menu_pos) {
-	case 2: switch (show_popups) {
+	case 1: if (router_busy()) msg = "Rerouting"; break;
+	case 3: switch (show_popups) {
 		case 0: msg = "No Popups"; break;
 		case 1: msg = "Popups"; break;
 		case 2: msg = "Permanent Popups"; break;
 		}
 		break;
-	case 3: msg = (show_metric?"Meters":"Miles"); break;
-	case 4: msg = (show_gpscoords?"Coordinates":"No Coordinates"); break;
-	case 5: msg = (show_time?"Time":"Distance"); break;
-	case 6: msg = (show_track?"Track":"No Track"); break;
-	case 7: switch (coord_format) {
+	case 4: msg = (show_metric?"Meters":"Miles"); break;
+	case 5: msg = (show_gpscoords?"Coordinates":"No Coordinates"); break;
+	case 6: msg = (show_time?"Time":"Distance"); break;
+	case 7: msg = (show_track?"Track":"No Track"); break;
+	case 8: switch (coord_format) {
 		case 0: msg = "DDD Coords"; break;
 		case 1: msg = "DMM Coords"; break;
 		case 2: msg = "DMS Coords"; break;
 		}
 		break;
+	case 9: msg = (heading_up?"Heading Up":"North Up"); break;
 	}
 	if (msg)
 	    draw_msg(msg);
     }
 
-    draw_display();
+    METRIC_END(M_RENDER, render);
 
-#ifndef __arm__
-    {
-	extern int stats_toTM;
-	extern int stats_distance;
-	extern int stats_bearing;
-
-	fprintf(stderr, "conv stats: GPS>TM %d DIST %d HDG %d\n",
-		stats_toTM, stats_distance, stats_bearing);
-	stats_toTM = stats_distance = stats_bearing = 0;
-    }
-#endif
+    METRIC_START(push);
+    draw_display();
+    METRIC_END(M_PUSH, push);
+    metrics_displayed(&render, &push);
 }
 
 static int handle_input(void)
@@ -188,6 +299,7 @@ static int handle_input(void)
 	    case VIEW_MAP:   visual = VIEW_ROUTE; break;
 	    case VIEW_ROUTE: visual = VIEW_SATS; break;
 	    }
+	    save_settings();
 	    /* allow for cycling by keeping the button pressed */
 	    pressed.tv_sec  = now.tv_sec;
 	    pressed.tv_usec = now.tv_usec;
@@ -228,26 +340,30 @@ static int handle_input(void)
 	else if (menu) {
 	    switch(menu_pos) {
 	    case 0: load_route = routes_init(); break;
-	    case 1:
+	    case 1: router_start(); break;
+	    case 2:
 		switch (visual) {
 		case VIEW_SATS:  visual = VIEW_MAP; break;
 		case VIEW_MAP:   visual = VIEW_ROUTE; break;
 		case VIEW_ROUTE: visual = VIEW_SATS; break;
 		}
 		break;
-	    case 2:
+	    case 3:
 		if (++show_popups == 3)
 		    show_popups = 0;
 		break;
-	    case 3: show_metric = 1 - show_metric; break;
-	    case 4: show_gpscoords = 1 - show_gpscoords;  break;
-	    case 5: show_time = 1 - show_time; break;
-	    case 6: show_track = 1 - show_track; break;
-	    case 7:
+	    case 4: show_metric = 1 - show_metric; break;
+	    case 5: show_gpscoords = 1 - show_gpscoords;  break;
+	    case 6: show_time = 1 - show_time; break;
+	    case 7: show_track = 1 - show_track; break;
+	    case 8:
 		if (++coord_format == 3)
 		    coord_format = 0;
 		break;
+	    case 9: heading_up = 1 - heading_up; break;
 	    }
+	    if (menu_pos > 1)
+		save_settings();
 	    menu = 0; lastmenu = 3; lastmenu_pos = menu_pos;
 	}
 	else
@@ -292,6 +408,11 @@ static int handle_input(void)
 
     case IR_KNOB_LEFT:
     case IR_KNOB_RIGHT:
+	if (load_route) {
+	    route_jump(key == IR_KNOB_RIGHT);
+	    do_refresh = 1;
+	    break;
+	}
 	route_skipwp(key == IR_KNOB_LEFT ? -1 : 1);
 	route_locate();
 	do_refresh = 1;
@@ -305,58 +426,11 @@ static int handle_input(void)
     return 0;
 }
 
-static void
-init_gpsapp()
-{
-    char buf[512];
-    ssize_t bytes = 0, done = 0;
-    int ret = 0;
-    int offset = 0;
-    int fd = open("empeg/var/config.ini", O_RDONLY);
-    int inside = 0;
-
-    if (fd == -1) return;
-
-    while ((bytes=read(fd, buf, 512))>CONFIG_HDRLEN) {
-	buf[bytes]='\0';
-	offset=CONFIG_HDRLEN; 
-	done+=bytes;
-	/* special cases, handled internal to config_ini_option */
-	config_ini_option (buf, "protocol", &inside);
-	config_ini_option (buf, "serialport", &inside);
-	config_ini_option (buf, "routedir", &inside);
-
-	ret = config_ini_option (buf, "visual", &inside);
-	if (ret > -1 && ret < 3) visual = ret;
-	ret = config_ini_option (buf, "metric", &inside);
-	if (ret > -1 && ret < 2) show_metric = ret;
-	ret = config_ini_option (buf, "gpscoords", &inside);
-	if (ret > -1 && ret < 2) show_gpscoords = ret;
-	ret = config_ini_option (buf, "coord_format", &inside);
-	if (ret > -1 && ret < 3) coord_format = ret;
-	ret = config_ini_option (buf, "track", &inside);
-	if (ret > -1 && ret < 2) show_track = ret;
-	ret = config_ini_option (buf, "scale", &inside);
-	if (ret > -1 && ret < 2) show_scale = ret;
-	ret = config_ini_option (buf, "popups", &inside);
-	if (ret > -1 && ret < 3) show_popups = ret;
-	ret = config_ini_option (buf, "time", &inside);
-	if (ret > -1 && ret < 2) show_time = ret;
-	ret = config_ini_option (buf, "coldstart", &inside);
-	if (ret > -1 && ret < 2) do_coldstart = ret;
-	if (lseek(fd, -CONFIG_HDRLEN, SEEK_CUR) != done- CONFIG_HDRLEN) {
-	    // bomb out?
-	}
-	done-=CONFIG_HDRLEN;
-    }
-    close(fd);
-}
-
 int main(int argc, char **argv)
 {
     const char *menu[] = { "GPSapp", NULL };
-    struct timeval timeout;
-    int rc = 0;
+    struct timeval timeout, now, next_frame = { 0, 0 };
+    int rc = 0, loading;
 
     if (empeg_init() == -1)
 	exit(0);
@@ -370,7 +444,7 @@ int main(int argc, char **argv)
     if (argc > 1)
 	serial_protocol(argv[1]);
 
-    init_gpsapp();
+    load_settings();
 
     printf("GPS app started\n");
 
@@ -378,7 +452,13 @@ int main(int argc, char **argv)
     vfdlib_registerFont("empeg/lib/fonts/large.bf", 1);
     h0 = vfdlib_getTextHeight(0);
 
+    eta_init();
     route_init();
+    route_offroute_hook = offroute_changed;
+    snapshot_init();
+    trackfile_open();
+    basemap_open();
+    router_open();
 
     while (rc != -1) {
 	if (empeg_waitmenu(menu) == -1)
@@ -393,12 +473,35 @@ int main(int argc, char **argv)
 	    rc = handle_input();
 	    if (rc) break;
 
+	    loading = route_poll();
+	    loading |= router_poll();
+
+	    if (config_changed())
+		reload_settings();
+
+	    /* move the map along between fixes */
+	    if (framerate && visual == VIEW_MAP) {
+		gettimeofday(&now, NULL);
+		if (filter_moving(&now) && !timercmp(&now, &next_frame, <)) {
+		    next_frame.tv_sec = now.tv_sec;
+		    next_frame.tv_usec = now.tv_usec + 1000000 / framerate;
+		    if (next_frame.tv_usec >= 1000000) {
+			next_frame.tv_sec++;
+			next_frame.tv_usec -= 1000000;
+		    }
+		    do_refresh = 1;
+		}
+	    }
+
 	    if (do_refresh)
 		refresh_display();
 
+	    metrics_dump();
+
 	    /* pause a bit to avoid burning CPU cycles */
 	    timeout.tv_sec = 0;
-	    timeout.tv_usec = 100000;
+	    timeout.tv_usec = framerate > 10 ? 1000000 / framerate : 100000;
+	    if (loading) timeout.tv_usec = 0;
 	    select(0, NULL, NULL, NULL, &timeout);
 	}
 #ifndef __arm__
@@ -407,6 +510,10 @@ int main(int argc, char **argv)
     }
 
     serial_close();
+    trackfile_close();
+    basemap_close();
+    router_close();
+    snapshot_free();
     route_init();
 
     draw_msg("GPS app dying...");
@@ -7,7 +7,9 @@
 #ifndef _GPSAPP_H_
 #define _GPSAPP_H_
 
+#include <sys/types.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #include <math.h>
 #include "gps_protocol.h"
 
@@ -20,7 +22,11 @@ extern int show_time;
 extern int coord_format; /* DDD = 0, DMM = 1, DMS = 2 */
 extern int do_coldstart;
 extern char *serport;
+extern int serbaud;
 extern char *routedir;
+extern char *statedir;
+extern int framerate;
+extern int heading_up;
 
 /* screen coordinates */
 struct xy { int x, y; };
@@ -35,15 +41,33 @@ struct coord {
 struct wp {
     int idx;
     char *short_desc;
+    char *desc;		/* turn instruction */
     short inhdg, outhdg;
+    short turn;		/* WP_* turn class */
+    short width[2];	/* pixel width of desc in both fonts */
 };
 
+/* turn classes, WP_LEFT is or-ed in for turns to the left */
+enum { WP_START = 0, WP_END, WP_CONTINUE, WP_BEAR, WP_TURN, WP_SHARP };
+#define WP_LEFT 0x10
+
 struct route {
     int	npts;
     int	nwps;
     struct xy *pts;
     struct wp *wps;
     int *dists;
+    char *text;		/* short descriptions and turn instructions of all
+			   waypoints, allocated on their own */
+    char *live;		/* room in text for the instruction of the closest wp */
+    char *arena;	/* pts, wps, dists and name are allocated from here */
+    int size;		/* of both blocks, charged to the route cache */
+
+    /* where it came from, for the cache of recently used routes */
+    char *name;
+    long fsize, mtime;
+    struct coord center;
+    struct route *next;
 };
 
 extern int h0;
@@ -57,10 +81,14 @@ extern struct coord coord_center;
 char *formatdist(char *buf, const unsigned int distance);
 char *formatalt(char *buf, const int alt);
 char *formatspeed(char *buf, const int speed);
-char *time_estimate(char *buf, const unsigned int distance);
+char *time_estimate(char *buf, const int wp, const unsigned int distance);
 char *format_coord(char *buf, double llr, char dir[2]);
 
 void toTM(struct coord *point);
+void projectTM(const struct coord *center, double lat, double lon,
+	       double *x, double *y);
+void inverseTM(const struct coord *center, double x, double y,
+	       double *lat, double *lon);
 long long distance2(const struct xy *coord1, const struct xy *coord2);
 double bearing(const struct xy *coord1, const struct xy *coord2);
 int towards(const struct xy *here, const struct xy *coord, const int dir);
@@ -82,48 +110,156 @@ void draw_wpstext(void);
 void draw_popup(char *text);
 void draw_display(void);
 void err(char *msg);
+void draw_setview(const struct xy *pos);
 void draw_sats(struct gps_state *gps);
+void draw_basemap(void);
+
+/* street map underneath the route (basemap.c) */
+#define BASEMAP_MAXPTS 255
+enum { ROAD_HIGHWAY = 0, ROAD_MAJOR, ROAD_LOCAL };
+extern char *basemapfile;
+void basemap_open(void);
+void basemap_close(void);
+int basemap_begin(const struct xy *min, const struct xy *max, int scale);
+int basemap_next(struct xy *pts, int *class);
+void basemap_prefetch(void);
+
+/* tiles of the map files kept in memory (tilecache.c) */
+extern int tilecache_size;
+unsigned char *tilecache_get(int fd, off_t offset, int size);
+int tilecache_has(int fd, off_t offset);
+void tilecache_flush(int fd);
 
 /* tracking functions (track.c) */
 void track_init(void);
 void track_pos(void);
 void track_draw(void);
 
-/* route functions (route.c) */
-extern int nextwp;
+/* index of the route directory (route_index.c) */
+struct route_info {
+    char *name;
+    char *start_desc, *end_desc;
+    long size, mtime;
+    struct coord center;
+    struct xy min, max;		/* bounding box */
+    struct xy start, end;
+};
+
+extern struct route_info *routes;
+extern int nroutes;
+char *route_path(char *buf, const char *name);
 int routes_init(void);
+void routes_stale(void);
+struct route_info *routes_selected(void);
 void routes_list(void);
 void route_select(int updown);
+void route_jump(int updown);
+
+/* route functions (route.c) */
+extern int nextwp;
 void route_load(void);
+int route_poll(void);
+int route_loading(void);
 void route_init(void);
 void route_locate(void);
 void route_skipwp(int dir);
 void route_draw(struct xy *cur_pos);
 int route_getwp(const int wp, struct xy *pos, unsigned int *dist, char **desc);
+int route_getwidth(const int wp, const int font);
 void route_recenter(void);
 void route_update_vmg(void);
+int route_ahead(const struct xy **pts);
+int route_dest(struct xy *pos, const char **name);
+int route_offroute(void);
+extern void (*route_offroute_hook)(int off);
+int route_replace(const struct xy *pts, int npts, const struct wp *wps,
+		  int nwps);
+
+/* finding a new way to the end of the route (router.c) */
+extern char *graphfile;
+void router_open(void);
+void router_close(void);
+void router_start(void);
+int router_poll(void);
+int router_busy(void);
+
+/* arrival time estimates (eta.c) */
+void eta_init(void);
+void eta_load(const char *name, const struct route *route);
+void eta_free(void);
+void eta_skip(void);
+void eta_update(const int nextwp, const unsigned int speed);
+int eta_seconds(const int wp, const unsigned int distance);
+
+/* smoothing and extrapolation of our position (filter.c) */
+void filter_reset(void);
+void filter_fix(const struct xy *pos, int have_vel, double ve, double vn,
+		const struct timeval *when);
+int filter_predict(struct xy *pos, const struct timeval *now);
+int filter_moving(const struct timeval *now);
+unsigned int filter_speed(void);
+int filter_heading(void);
 
 /* serial port/gps interfacing functions (serial.c) */
 
 extern struct gps_state gps_state;
 extern struct coord     gps_coord;
 extern unsigned int	gps_speed;     /* current speed measurement */
-extern int              gps_avgvmg;    /* average velocity made good */
-extern int		gps_bearing;   /* last 'stable' bearing measurement */
-#define AVGVMG_SHIFT 6
+extern int		gps_bearing;   /* filtered bearing, -1 if unknown */
 
 void serial_protocol(char *proto);
 void serial_open(void);
 void serial_close(void);
 void serial_poll(void);
 
+/* track recorder (trackfile.c) */
+extern char *trackfile;
+void trackfile_open(void);
+void trackfile_close(void);
+void trackfile_fix(const struct gps_state *gps);
+
+/* position published in shared memory (snapshot.c) */
+void snapshot_init(void);
+void snapshot_free(void);
+void snapshot_update(void);
+
+/* NMEA relay server, only used by the receiver thread (relay.c) */
+extern char *relayaddr;
+int  relay_open(void);
+void relay_close(void);
+void relay_write(const char *buf, int len);
+int  relay_fdset(fd_set *rfds, fd_set *wfds, int maxfd);
+void relay_service(fd_set *rfds, fd_set *wfds);
+
 /* config file parser (config.c) */
 #define CONFIG_HEADER "[gpsapp]"
 #define CONFIG_HDRLEN 8
-int config_ini_option (char *s, char *match, int *inside);
+
+struct config_option {
+    char *name;
+    int (*handler)(const struct config_option *opt, char *value);
+    void *var;
+    int max;	/* largest number accepted by config_choice and config_int */
+    int flags;
+};
+#define CONFIG_STARTUP 1 /* only read when we start, not when reloading */
+#define CONFIG_MENU    2 /* int that can be changed from the menu */
+
+/* handlers for the common types of options */
+int config_choice(const struct config_option *opt, char *value);
+int config_int(const struct config_option *opt, char *value);
+int config_string(const struct config_option *opt, char *value);
+
+int config_read(const char *path, const struct config_option *options,
+		int reload);
+int config_save(const char *path, const struct config_option *options);
+void config_watch(const char *path);
+int config_changed(void);
 
 /* figure out what the current visual is (gpsapp.c) */
 int get_visual(void);
+void timesub(struct timeval *res, struct timeval *from, struct timeval *val);
+char *state_path(char *buf, const char *name);
 
 /* zodiac data send function (for init) (gps_earthmate.c) */
 void zodiac_send (int type, unsigned short *dat, int dlen);
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+#ifndef _GPSAPP_SHM_H_
+#define _GPSAPP_SHM_H_
+
+/*
+ * gpsapp publishes its current position in a shared memory segment, so that
+ * other programs on the empeg don't have to parse NMEA or talk to gpsd. Map
+ * GPSAPP_SHM_FILE read-only and use gpsapp_shm_read to get a consistent copy,
+ *
+ *	fd = open(GPSAPP_SHM_FILE, O_RDONLY);
+ *	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+ *	...
+ *	if (gpsapp_shm_read(shm, &pos) == 0)
+ *	    use pos.state.lat, pos.next_desc, ...
+ *
+ * Readers never block gpsapp, and after the mmap they don't need any
+ * syscalls. The version number changes whenever the layout changes.
+ */
+
+#include <string.h>
+#include "gpsapp.h"
+#include "seqlock.h"
+
+#define GPSAPP_SHM_FILE	   "/tmp/gpsapp.shm"
+#define GPSAPP_SHM_MAGIC   0x47505341 /* GPSA */
+#define GPSAPP_SHM_VERSION 3
+
+struct gpsapp_shm {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;		 /* sizeof(struct gpsapp_shm) */
+    seqlock_t	 lock;
+
+    unsigned int     updates;	 /* incremented for every published update */
+    struct gps_state state;	 /* as decoded from the receiver */
+    struct coord     coord;	 /* position projected around center */
+    struct coord     center;
+    unsigned int     speed;	 /* meters per hour */
+    int		     bearing;	 /* degrees, -1 when unknown */
+
+    /* next waypoint on the route, next_wp is -1 if no route is loaded */
+    int		 next_wp;
+    struct xy	 next_pos;
+    unsigned int next_dist;	 /* meters */
+    int		 next_eta;	 /* seconds, -1 when unknown */
+    char	 next_desc[80];
+
+    /* final destination of the route, 0 and -1 if no route is loaded */
+    unsigned int dest_dist;	 /* meters */
+    int		 dest_eta;	 /* seconds, -1 when unknown */
+
+    int		 off_route;	 /* meters, 0 while we're following it */
+};
+
+/* returns 0 with a consistent copy of the published data in pos */
+static inline int gpsapp_shm_read(const struct gpsapp_shm *shm,
+				  struct gpsapp_shm *pos)
+{
+    unsigned int seq;
+
+    if (shm->magic != GPSAPP_SHM_MAGIC || shm->version != GPSAPP_SHM_VERSION ||
+	shm->size != sizeof(struct gpsapp_shm))
+	return -1;
+
+    do {
+	seq = read_seqbegin(&shm->lock);
+	memcpy(pos, shm, sizeof(*pos));
+    } while (read_seqretry(&shm->lock, seq));
+
+    return 0;
+}
+
+#endif
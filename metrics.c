@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Keeps the numbers declared in metrics.h. Latencies go in power of two
+ * buckets of microseconds, which only takes a couple of shifts per sample,
+ * so this is cheap enough to leave enabled on the empeg.
+ *
+ * METRICS_FILE has one line per counter, "name value", followed by one line
+ * per histogram, "name count avg max" (in microseconds) and then the number
+ * of samples below 1, 2, 4, 8, ... microseconds. Everything counts from
+ * when gpsapp started, so compare two dumps to see what happened in between.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "gpsapp.h"
+#include "metrics.h"
+
+#ifdef METRICS
+
+#define METRIC_BUCKETS 24 /* the last one collects everything above 4s */
+
+static const char *stage_names[M_STAGES] = {
+    "read", "decode", "project", "locate", "render", "push", "latency"
+};
+static const char *count_names[C_COUNTERS] = {
+    "messages", "checksum", "dropped", "refresh",
+    "toTM", "distance", "bearing", "tile_hit", "tile_read",
+    "tile_prefetch", "offroute"
+};
+
+static struct metric_hist {
+    unsigned int count, max;
+    unsigned long long total;
+    unsigned int bucket[METRIC_BUCKETS];
+} hist[M_STAGES];
+
+unsigned int metric_count[C_COUNTERS];
+
+static struct timeval fix_stamp; /* when the last fix was read */
+static struct timeval fix_done;	 /* when we were done processing it */
+static unsigned int fix_seq;
+static int fix_pending;		 /* it hasn't been displayed yet */
+
+static void metric_add(int m, unsigned int usec)
+{
+    struct metric_hist *h = &hist[m];
+    int b = 0;
+
+    while (b < METRIC_BUCKETS - 1 && (usec >> b))
+	b++;
+
+    h->count++;
+    h->total += usec;
+    if (usec > h->max)
+	h->max = usec;
+    h->bucket[b]++;
+}
+
+static unsigned int usec_between(const struct timeval *from,
+				 const struct timeval *to)
+{
+    struct timeval a = *from, b = *to, diff;
+
+    timesub(&diff, &b, &a);
+    if (diff.tv_sec < 0)
+	return 0;
+    return diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+static unsigned int usec_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return usec_between(start, &now);
+}
+
+void metric_time(int m, const struct timeval *start)
+{
+    metric_add(m, usec_since(start));
+}
+
+#ifndef __arm__
+static FILE *trace;
+static struct timeval trace_base;
+
+static void trace_span(const char *name, const struct timeval *from,
+		       const struct timeval *to)
+{
+    static int checked;
+    char *path;
+
+    if (!checked) {
+	checked = 1;
+	path = getenv("GPSAPP_TRACE");
+	if (path)
+	    trace = fopen(path, "w");
+	if (!trace)
+	    return;
+	/* the closing bracket is optional, so we can stop at any time */
+	fputs("[\n", trace);
+	trace_base = *from;
+    }
+    if (!trace)
+	return;
+
+    fprintf(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+	    "\"ts\":%u,\"dur\":%u,\"args\":{\"seq\":%u}},\n", name,
+	    usec_between(&trace_base, from), usec_between(from, to), fix_seq);
+}
+#else
+#define trace_span(name, from, to) do { } while (0)
+#endif
+
+/* called when we're done with a new fix, start is when we began on it */
+void metrics_fix(const struct gps_state *gps, const struct timeval *start)
+{
+    fix_stamp = gps->stamp;
+    fix_seq = gps->seq;
+    gettimeofday(&fix_done, NULL);
+    fix_pending = 1;
+
+    /* waiting in the serial buffer, the main loop's sleep and the
+     * UPDATE_INTERVAL gate */
+    trace_span("queued", &fix_stamp, start);
+    trace_span("process", start, &fix_done);
+}
+
+/* called when a frame went out, only the first frame showing a fix counts
+ * towards the latency */
+void metrics_displayed(const struct timeval *render, const struct timeval *push)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (fix_pending)
+	trace_span("wait", &fix_done, render);
+    trace_span("render", render, push);
+    trace_span("push", push, &now);
+
+    if (!fix_pending)
+	return;
+
+    metric_add(M_LATENCY, usec_between(&fix_stamp, &now));
+    fix_pending = 0;
+}
+
+void metrics_dump(void)
+{
+    static time_t next_dump;
+    time_t now = time(NULL);
+    struct metric_hist *h;
+    FILE *f;
+    int i, b;
+
+    if (now < next_dump)
+	return;
+    next_dump = now + METRICS_INTERVAL;
+
+    /* readers never see a partially written file */
+    f = fopen(METRICS_FILE ".tmp", "w");
+    if (!f) return;
+
+    for (i = 0; i < C_COUNTERS; i++)
+	fprintf(f, "%s %u\n", count_names[i], metric_count[i]);
+
+    for (i = 0; i < M_STAGES; i++) {
+	h = &hist[i];
+	fprintf(f, "%s %u %u %u", stage_names[i], h->count,
+		h->count ? (unsigned int)(h->total / h->count) : 0, h->max);
+	for (b = 0; b < METRIC_BUCKETS; b++)
+	    fprintf(f, " %u", h->bucket[b]);
+	fputc('\n', f);
+    }
+
+    if (fclose(f) == 0)
+	rename(METRICS_FILE ".tmp", METRICS_FILE);
+
+#ifndef __arm__
+    if (trace)
+	fflush(trace);
+#endif
+}
+
+#endif /* METRICS */
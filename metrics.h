@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+/*
+ * Counters and latency histograms for the work done on every fix. Built in
+ * when compiled with -DMETRICS, otherwise all of this compiles away. The
+ * numbers are written to METRICS_FILE every METRICS_INTERVAL seconds while
+ * we're running,
+ *
+ *	struct timeval t;
+ *	METRIC_START(t);
+ *	...
+ *	METRIC_END(M_LOCATE, t);
+ *	METRIC_COUNT(C_CHECKSUM);
+ *
+ * Every histogram and counter is only updated from one thread, so there is
+ * no locking. The dump may read a value that is being updated, which only
+ * makes it a little off.
+ *
+ * On the host GPSAPP_TRACE=<file> also writes a Chrome trace (load it in
+ * chrome://tracing) showing where every fix spent its time on the way from
+ * the receiver to the display.
+ */
+
+#include <sys/time.h>
+
+#define METRICS_FILE	 "/tmp/gpsapp.metrics"
+#define METRICS_INTERVAL 10 /* seconds */
+
+struct gps_state;
+
+/* latency histograms */
+enum {
+    M_READ = 0,	/* read from the serial port or gpsd (receiver thread) */
+    M_DECODE,	/* decoding what we read (receiver thread) */
+    M_PROJECT,	/* projecting a fix on the map */
+    M_LOCATE,	/* finding where we are on the route */
+    M_RENDER,	/* drawing a frame */
+    M_PUSH,	/* pushing a frame to the display */
+    M_LATENCY,	/* age of a fix when it is first on the display */
+    M_STAGES
+};
+
+/* counters */
+enum {
+    C_MESSAGES = 0, /* decoded messages (receiver thread) */
+    C_CHECKSUM,	    /* messages with a bad checksum (receiver thread) */
+    C_DROPPED,	    /* garbled or overly long messages (receiver thread) */
+    C_REFRESH,	    /* display refreshes */
+    C_TOTM,	    /* calls to toTM, distance2 and bearing, these are also
+		       made by the receiver thread when replaying a track */
+    C_DISTANCE,
+    C_BEARING,
+    C_TILE_HIT,	    /* tiles found in the tile cache */
+    C_TILE_READ,    /* tiles read from disk */
+    C_TILE_PREFETCH, /* of those, read before they were in view */
+    C_OFFROUTE,	    /* times we left the route */
+    C_COUNTERS
+};
+
+#ifdef METRICS
+extern unsigned int metric_count[C_COUNTERS];
+
+#define METRIC_COUNT(c)	     (metric_count[c]++)
+#define METRIC_ADD(c, n)     (metric_count[c] += (n))
+#define METRIC_START(tv)     gettimeofday(&(tv), NULL)
+#define METRIC_END(m, tv)    metric_time(m, &(tv))
+
+void metric_time(int m, const struct timeval *start);
+void metrics_fix(const struct gps_state *gps, const struct timeval *start);
+void metrics_displayed(const struct timeval *render, const struct timeval *push);
+void metrics_dump(void);
+#else
+#define METRIC_COUNT(c)	     do { } while (0)
+#define METRIC_ADD(c, n)     do { } while (0)
+#define METRIC_START(tv)     ((void)&(tv))
+#define METRIC_END(m, tv)    do { } while (0)
+
+#define metrics_fix(gps, start)		do { } while (0)
+#define metrics_displayed(render, push) do { } while (0)
+#define metrics_dump()	     do { } while (0)
+#endif
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,302 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+# This code is distributed "AS IS" without warranty of any kind under the
+# terms of the GNU General Public License Version 2.
+#
+# Makes a street map for the basemap= option out of OpenStreetMap extracts
+# (.osm) and Tiger/Line shapefiles (.shp, with the .dbf next to it).
+#
+# usage: mkbasemap.py <basemap> <input>...
+#
+# The roads are projected around the center of all the input and cut into
+# 4km tiles. There are 3 levels of detail, with tiles and units that grow 8
+# times from one to the next. The top level only has the highways, the next
+# one the major roads as well, and every level is simplified to what can
+# still be seen at the scales it is drawn at. See basemap.c for the format.
+#
+import sys, struct, math, xml.sax
+from convert import *
+
+HIGHWAY, MAJOR, LOCAL = range(3)
+
+TILE_SHIFT = 12		# level 0 tiles are 4096m, and every tile 4096 units
+LEVEL_SHIFT = 3
+MAXPTS = 255
+
+# road classes kept and how far points may move when simplifying (meters)
+levels = [ (LOCAL, 2.0), (MAJOR, 32.0), (HIGHWAY, 256.0) ]
+
+osm_classes = {
+    'motorway': HIGHWAY, 'motorway_link': HIGHWAY,
+    'trunk': HIGHWAY, 'trunk_link': HIGHWAY,
+    'primary': MAJOR, 'primary_link': MAJOR,
+    'secondary': MAJOR, 'secondary_link': MAJOR,
+    'tertiary': LOCAL, 'tertiary_link': LOCAL, 'unclassified': LOCAL,
+    'residential': LOCAL, 'living_street': LOCAL, 'service': LOCAL,
+    'road': LOCAL,
+}
+
+class osmhandler(xml.sax.ContentHandler):
+    def __init__(self):
+	xml.sax.ContentHandler.__init__(self)
+	self.nodes = {}
+	self.lines = []
+	self.refs = None
+
+    def startElement(self, name, attrs):
+	if name == 'node':
+	    self.nodes[attrs['id']] = (float(attrs['lat']), float(attrs['lon']))
+	elif name == 'way':
+	    self.refs = []
+	    self.tags = {}
+	elif name == 'nd' and self.refs is not None:
+	    self.refs.append(attrs['ref'])
+	elif name == 'tag' and self.refs is not None:
+	    self.tags[attrs['k']] = attrs['v']
+
+    def endElement(self, name):
+	if name != 'way': return
+	cls = osm_classes.get(self.tags.get('highway'))
+	if cls is not None:
+	    pts = [ self.nodes[r] for r in self.refs if self.nodes.has_key(r) ]
+	    name = self.tags.get('name') or self.tags.get('ref') or ''
+	    self.lines.append((cls, pts, name.encode('ascii', 'replace'),
+			       osm_oneway(self.tags)))
+	self.refs = None
+
+# 1 when the way can only be driven in the direction it is drawn, -1 for
+# the other way, motorways are one way unless tagged otherwise
+def osm_oneway(tags):
+    v = tags.get('oneway')
+    if v in ('yes', 'true', '1'): return 1
+    if v == '-1': return -1
+    if v is None and tags.get('highway') in ('motorway', 'motorway_link'):
+	return 1
+    return 0
+
+def read_osm(name):
+    h = osmhandler()
+    xml.sax.parse(name, h)
+    return h.lines
+
+def read_dbf(name):
+    f = open(name, 'rb')
+    hdr = f.read(32)
+    nrecs, hdrlen, reclen = struct.unpack('<IHH', hdr[4:12])
+    fields = []
+    while 1:
+	d = f.read(32)
+	if not d or d[0] == '\r': break
+	fields.append((d[:11].split('\0')[0], ord(d[16])))
+
+    f.seek(hdrlen)
+    for i in range(nrecs):
+	rec = f.read(reclen)
+	vals = {}
+	pos = 1
+	for field, size in fields:
+	    vals[field] = rec[pos:pos+size].strip()
+	    pos = pos + size
+	yield vals
+
+def tiger_name(rec):
+    if rec.get('FULLNAME'): return rec['FULLNAME']
+    name = [ rec.get(f) for f in ('FEDIRP', 'FENAME', 'FETYPE', 'FEDIRS') ]
+    return ' '.join([ n for n in name if n ])
+
+# MTFCC in the current Tiger/Line files, CFCC in the older ones
+def tiger_class(rec):
+    c = rec.get('MTFCC') or rec.get('CFCC') or ''
+    if c == 'S1100' or c[:2] == 'A1': return HIGHWAY
+    if c == 'S1200' or c[:2] in ('A2', 'A3'): return MAJOR
+    if c[:2] == 'S1' or c[:1] == 'A': return LOCAL
+    return None
+
+def read_shp(name):
+    lines = []
+    f = open(name, 'rb')
+    f.seek(100)
+    for rec in read_dbf(name[:-4] + '.dbf'):
+	hdr = f.read(8)
+	if len(hdr) < 8: break
+	data = f.read(struct.unpack('>ii', hdr)[1] * 2)
+
+	# polylines, the Z and M variants have the same layout up front
+	cls = tiger_class(rec)
+	if cls is None or struct.unpack('<i', data[:4])[0] not in (3, 13, 23):
+	    continue
+
+	nparts, npts = struct.unpack('<ii', data[36:44])
+	parts = struct.unpack('<%di' % nparts, data[44:44+4*nparts]) + (npts,)
+	xy = struct.unpack('<%dd' % (2 * npts),
+			   data[44+4*nparts:44+4*nparts+16*npts])
+	for i in range(nparts):
+	    lines.append((cls, [ (xy[2*j+1], xy[2*j])
+				 for j in range(parts[i], parts[i+1]) ],
+			  tiger_name(rec), 0))
+    return lines
+
+# Douglas-Peucker, without recursion because roads can be long
+def simplify(pts, tol):
+    if len(pts) < 3: return pts
+    keep = [0] * len(pts)
+    keep[0] = keep[-1] = 1
+    todo = [ (0, len(pts) - 1) ]
+    while todo:
+	a, b = todo.pop()
+	ax, ay = pts[a]
+	dx, dy = pts[b][0] - ax, pts[b][1] - ay
+	l = math.hypot(dx, dy)
+	best, idx = tol, -1
+	for i in range(a + 1, b):
+	    px, py = pts[i][0] - ax, pts[i][1] - ay
+	    if l: d = abs(dx * py - dy * px) / l
+	    else: d = math.hypot(px, py)
+	    if d > best: best, idx = d, i
+	if idx >= 0:
+	    keep[idx] = 1
+	    todo.append((a, idx))
+	    todo.append((idx, b))
+    return [ pts[i] for i in range(len(pts)) if keep[i] ]
+
+# no segment longer than half a tile, so every point of a line in a tile is
+# within half a tile of it and the deltas fit in 16 bits
+def split(pts):
+    maxlen = (1 << TILE_SHIFT) / 2
+    out = [ pts[0] ]
+    for x, y in pts[1:]:
+	x0, y0 = out[-1]
+	n = int(max(abs(x - x0), abs(y - y0)) / maxlen) + 1
+	for i in range(1, n):
+	    out.append((x0 + (x - x0) * i / n, y0 + (y - y0) * i / n))
+	out.append((x, y))
+    return out
+
+# every segment goes to all tiles its bounding box overlaps, consecutive
+# segments in the same tile are kept together
+def cut(tiles, cls, pts):
+    pieces = {}
+    for i in range(len(pts) - 1):
+	(x0, y0), (x1, y1) = pts[i], pts[i+1]
+	for tx in range(min(x0, x1) >> TILE_SHIFT, (max(x0, x1) >> TILE_SHIFT) + 1):
+	    for ty in range(min(y0, y1) >> TILE_SHIFT,
+			    (max(y0, y1) >> TILE_SHIFT) + 1):
+		p = pieces.get((tx, ty))
+		if p and p[-1] == pts[i] and len(p) < MAXPTS:
+		    p.append(pts[i+1])
+		    continue
+		if p: tiles.setdefault((tx, ty), []).append((cls, p))
+		pieces[(tx, ty)] = [ pts[i], pts[i+1] ]
+    for t, p in pieces.items():
+	tiles.setdefault(t, []).append((cls, p))
+
+def make_level(lines, level):
+    maxcls, tol = levels[level]
+    unit = float(1 << (level * LEVEL_SHIFT))
+    tiles = {}
+    for cls, pts in lines:
+	if cls > maxcls: continue
+	q = []
+	for x, y in simplify(pts, tol):
+	    p = (int(math.floor(x / unit + 0.5)), int(math.floor(y / unit + 0.5)))
+	    if not q or q[-1] != p: q.append(p)
+	if len(q) > 1:
+	    cut(tiles, cls, split(q))
+    return tiles
+
+def encode(tx, ty, lines):
+    if len(lines) > 0xffff:
+	print "tile %d,%d has too many lines, dropped %d" % \
+	    (tx, ty, len(lines) - 0xffff)
+	lines = lines[:0xffff]
+    out = [ struct.pack('<H', len(lines)) ]
+    for cls, pts in lines:
+	x, y = tx << TILE_SHIFT, ty << TILE_SHIFT
+	d = []
+	for px, py in pts:
+	    d.extend([ px - x, py - y ])
+	    x, y = px, py
+	out.append(struct.pack('<BB%dh' % len(d), cls, len(pts), *d))
+    return ''.join(out)
+
+def write_basemap(name, center, grids):
+    hdr = struct.pack('<4sHHiiHHI', 'GMAP', 1, len(grids),
+		      int(round(center.lat * 1e6)), int(round(center.long * 1e6)),
+		      TILE_SHIFT, LEVEL_SHIFT, 0)
+    offset = len(hdr) + 16 * len(grids)
+
+    # the directories come first, then the tiles row by row
+    dims = []
+    for tiles in grids:
+	if tiles:
+	    xs = [ t[0] for t in tiles.keys() ]
+	    ys = [ t[1] for t in tiles.keys() ]
+	    tx0, ty0 = min(xs), min(ys)
+	    ncols, nrows = max(xs) - tx0 + 1, max(ys) - ty0 + 1
+	else:
+	    tx0, ty0, ncols, nrows = 0, 0, 1, 1
+	if ncols > 0xffff or nrows > 0xffff:
+	    raise ValueError, "the map is too large"
+	dims.append((tx0, ty0, ncols, nrows, offset))
+	offset = offset + ncols * nrows * 8
+
+    levelhdrs, dirs, data = [], [], []
+    for level in range(len(grids)):
+	tx0, ty0, ncols, nrows, diroff = dims[level]
+	levelhdrs.append(struct.pack('<iiHHI', tx0, ty0, ncols, nrows, diroff))
+	size = 0
+	for ty in range(ty0, ty0 + nrows):
+	    for tx in range(tx0, tx0 + ncols):
+		lines = grids[level].get((tx, ty))
+		if not lines:
+		    dirs.append(struct.pack('<II', 0, 0))
+		    continue
+		blob = encode(tx, ty, lines)
+		dirs.append(struct.pack('<II', offset, len(blob)))
+		data.append(blob)
+		offset = offset + len(blob)
+		size = size + len(blob)
+	print "level %d: %d tiles, %d bytes" % (level, len(grids[level]), size)
+
+    out = open(name, 'wb')
+    out.write(hdr + ''.join(levelhdrs) + ''.join(dirs) + ''.join(data))
+    out.close()
+
+# all roads in the input files as (class, [(lat, lon)...], name, oneway)
+def read_roads(names):
+    lines = []
+    for name in names:
+	if name[-4:].lower() == '.shp': lines.extend(read_shp(name))
+	else: lines.extend(read_osm(name))
+    lines = [ l for l in lines if len(l[1]) > 1 ]
+    if not lines:
+	print "no roads found"
+	sys.exit(1)
+    return lines
+
+# rounded the same way it is stored, so we project around the same spot
+def find_center(lines):
+    lats = [ p[0] for l in lines for p in l[1] ]
+    lons = [ p[1] for l in lines for p in l[1] ]
+    return Coord(round((min(lats) + max(lats)) / 2, 6),
+		 round((min(lons) + max(lons)) / 2, 6))
+
+def main(argv):
+    if len(argv) < 3:
+	print "usage: %s <basemap> <input.osm|input.shp>..." % argv[0]
+	sys.exit(1)
+
+    lines = read_roads(argv[2:])
+    center = find_center(lines)
+
+    projected = []
+    for l in lines:
+	projected.append((l[0], [ toTM(Coord(lat, lon), center, UTM_k0,
+					Datum_WGS84) for lat, lon in l[1] ]))
+
+    grids = [ make_level(projected, level) for level in range(len(levels)) ]
+    write_basemap(argv[1], center, grids)
+
+if __name__ == '__main__':
+    main(sys.argv)
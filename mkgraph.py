@@ -0,0 +1,157 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+# This code is distributed "AS IS" without warranty of any kind under the
+# terms of the GNU General Public License Version 2.
+#
+# Makes the road graph for the graph= option, which is used to find a new
+# way to the end of the route when we leave it. It reads the same
+# OpenStreetMap extracts and Tiger/Line shapefiles as mkbasemap.py.
+#
+# usage: mkgraph.py <graph> <input>...
+#
+# Every point where roads meet, and every end of a road, becomes a node.
+# The edges between them carry their length, road class, name and the shape
+# of the road in between. See router.c for the format.
+#
+import sys, struct, math
+from convert import *
+from mkbasemap import read_roads, find_center
+
+CELL_SHIFT = 10		# nodes are sorted by the 1km cell they are in
+MAXDELTA = 30000	# meters, longest step in the shape of an edge
+EDGE_REVERSED = 0x80000000
+EDGE_LENGTH = 0xffffff
+
+def project(center, lat, lon):
+    x, y = toTM(Coord(lat, lon), center, UTM_k0, Datum_WGS84)
+    return (int(math.floor(x + 0.5)), int(math.floor(y + 0.5)))
+
+# the points in between two nodes, the first one relative to the node we
+# start from and every next one relative to the one before it
+def encode_shape(start, pts):
+    d = []
+    x, y = start
+    for px, py in pts:
+	# break up steps that don't fit in 16 bits
+	n = int(max(abs(px - x), abs(py - y)) / MAXDELTA) + 1
+	lx, ly = x, y
+	for i in range(1, n + 1):
+	    qx, qy = x + (px - x) * i / n, y + (py - y) * i / n
+	    d.append((qx - lx, qy - ly))
+	    lx, ly = qx, qy
+	x, y = px, py
+    out = struct.pack('<H', len(d)) + \
+	''.join([ struct.pack('<hh', dx, dy) for dx, dy in d ])
+    return out + '\0' * (-len(out) % 4)
+
+def length(pts):
+    l = 0.0
+    for i in range(len(pts) - 1):
+	l = l + math.hypot(pts[i+1][0] - pts[i][0], pts[i+1][1] - pts[i][1])
+    return max(1, min(int(l + 0.5), EDGE_LENGTH))
+
+def main(argv):
+    if len(argv) < 3:
+	print "usage: %s <graph> <input.osm|input.shp>..." % argv[0]
+	sys.exit(1)
+
+    lines = read_roads(argv[2:])
+    center = find_center(lines)
+
+    # points that are used more than once are junctions
+    uses = {}
+    for cls, pts, name, oneway in lines:
+	for p in pts: uses[p] = uses.get(p, 0) + 1
+	uses[pts[0]] = uses[pts[0]] + 1
+	uses[pts[-1]] = uses[pts[-1]] + 1
+
+    xy = {}
+    for p, n in uses.items():
+	if n > 1: xy[p] = project(center, p[0], p[1])
+
+    # nodes sorted by cell, row by row
+    cell = lambda q: (q[1] >> CELL_SHIFT, q[0] >> CELL_SHIFT)
+    order = xy.keys()
+    order.sort(lambda a, b: cmp(cell(xy[a]), cell(xy[b])))
+    nodeid = {}
+    for i in range(len(order)): nodeid[order[i]] = i
+
+    # the edges, both ways unless the road is one way
+    names = { '': 0 }
+    namedata = [ '\0' ]
+    shapes = []
+    shapesize = 0
+    out = [ [] for i in order ]
+    for cls, pts, name, oneway in lines:
+	if not names.has_key(name):
+	    names[name] = len(''.join(namedata))
+	    namedata.append(name + '\0')
+
+	start = 0
+	for i in range(1, len(pts)):
+	    if not nodeid.has_key(pts[i]): continue
+	    a, b = nodeid[pts[start]], nodeid[pts[i]]
+	    shape = [ project(center, p[0], p[1]) for p in pts[start+1:i] ]
+	    start = i
+	    if a == b: continue
+
+	    blob = encode_shape(xy[order[a]], shape)
+	    offset = shapesize
+	    shapes.append(blob)
+	    shapesize = shapesize + len(blob)
+
+	    info = length([ xy[order[a]] ] + shape + [ xy[order[b]] ]) | \
+		(cls << 24)
+	    if oneway >= 0:
+		out[a].append((b, offset, names[name], info))
+	    if oneway <= 0:
+		out[b].append((a, offset, names[name], info | EDGE_REVERSED))
+
+    # cell index, where the nodes of every cell start
+    cxs = [ xy[p][0] >> CELL_SHIFT for p in order ]
+    cys = [ xy[p][1] >> CELL_SHIFT for p in order ]
+    cx0, cy0 = min(cxs), min(cys)
+    ncols, nrows = max(cxs) - cx0 + 1, max(cys) - cy0 + 1
+    if ncols > 0xffff or nrows > 0xffff:
+	raise ValueError, "the map is too large"
+    cells = [ 0 ] * (ncols * nrows + 1)
+    for i in range(len(order)):
+	cells[(cys[i] - cy0) * ncols + cxs[i] - cx0 + 1] += 1
+    for i in range(1, len(cells)):
+	cells[i] = cells[i] + cells[i-1]
+
+    first = [ 0 ]
+    edges = []
+    for i in range(len(order)):
+	edges.extend(out[i])
+	first.append(len(edges))
+
+    sections = [
+	struct.pack('<%dI' % len(cells), *cells),
+	''.join([ struct.pack('<ii', xy[p][0], xy[p][1]) for p in order ]),
+	struct.pack('<%dI' % len(first), *first),
+	''.join([ struct.pack('<IIII', *e) for e in edges ]),
+	''.join(shapes),
+	''.join(namedata),
+    ]
+    offsets = []
+    offset = 64
+    for s in sections:
+	offsets.append(offset)
+	offset = offset + len(s) + (-len(s) % 4)
+
+    hdr = struct.pack('<4sHHiiIIiiHH7I', 'GRPH', 1, CELL_SHIFT,
+		      int(round(center.lat * 1e6)), int(round(center.long * 1e6)),
+		      len(order), len(edges), cx0, cy0, ncols, nrows,
+		      *(offsets + [ offset ]))
+
+    f = open(argv[1], 'wb')
+    f.write(hdr)
+    for s in sections:
+	f.write(s + '\0' * (-len(s) % 4))
+    f.close()
+    print "%d nodes, %d edges, %d bytes" % (len(order), len(edges), offset)
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,167 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+# This code is distributed "AS IS" without warranty of any kind under the
+# terms of the GNU General Public License Version 2.
+#
+# Generates a made up route and a drive along it, used by 'make bench'.
+#
+# usage: mkroute.py [-p points] [-w waypoints] [-l km] [-s seed] <route> <track>
+#
+# The route alternates between local roads, highways and ramps, with a turn
+# at every waypoint. The drive is written as a gpstrans tracklog, one fix a
+# second, with some noise on the positions, stops on local roads and now and
+# then a detour of a few hundred meters away from the route.
+#
+import sys, os, math, random, time, calendar, getopt
+from convert import *
+
+LOCAL, HIGHWAY, RAMP = range(3)
+
+# relative length, speed (m/s), turn at the start, curviness
+roadclass = {
+    LOCAL:   (1.0, 12.0, 90.0, 0.2),
+    HIGHWAY: (6.0, 29.0, 20.0, 0.02),
+    RAMP:    (0.3, 14.0, 30.0, 2.0),
+}
+
+streets = [ "FORBES AV", "MOREWOOD AV", "5TH AV", "THOMAS ST", "MURRAY AV",
+	    "PENN AV", "LIBERTY AV", "BAUM BLVD", "NEGLEY AV", "WALNUT ST" ]
+
+START = (40.449754, -79.926868)
+EPOCH = calendar.timegm((2002, 9, 14, 13, 0, 0))
+NOISE = 4.0	# meters
+DETOUR = 300.0	# meters
+
+def roadname(cls, n):
+    if cls == HIGHWAY: return "I-%d" % random.choice([70, 76, 79, 279, 376])
+    if cls == RAMP:    return "EXIT %d RAMP" % n
+    return random.choice(streets)
+
+def make_roads(nroads, length):
+    roads = []
+    for i in range(nroads):
+	r = random.random()
+	if   r < 0.5:  cls = LOCAL
+	elif r < 0.85: cls = HIGHWAY
+	else:	       cls = RAMP
+	roads.append([cls, roadname(cls, i), roadclass[cls][0]])
+    total = 0.0
+    for road in roads: total = total + road[2]
+    for road in roads: road[2] = road[2] * length / total
+    return roads
+
+# walk the roads in meters east/north of the start, returns the points as
+# (x, y, desc, class)
+def walk(roads, npoints, length):
+    step = length / npoints
+    x = y = 0.0
+    hdg = random.uniform(0.0, 360.0)
+    pts = [ (x, y, "(start of the route)", LOCAL) ]
+    for cls, name, dist in roads:
+	turn, curvy = roadclass[cls][2], roadclass[cls][3]
+	hdg = hdg + random.choice([-turn, turn])
+	n = max(1, int(dist / step + 0.5))
+	desc = name
+	for i in range(n):
+	    hdg = hdg + random.gauss(0.0, curvy)
+	    x = x + step * math.sin(math.radians(hdg))
+	    y = y + step * math.cos(math.radians(hdg))
+	    pts.append((x, y, desc, cls))
+	    desc = None
+    x, y, desc, cls = pts[-1]
+    pts[-1] = (x, y, "(end of the route)", cls)
+    return pts
+
+# flat earth is good enough around here
+def to_coord(x, y):
+    lat = START[0] + y / 111320.0
+    lon = START[1] + x / (111320.0 * math.cos(math.radians(START[0])))
+    return Coord(lat, lon)
+
+def write_route(name, pts):
+    coords = [ to_coord(p[0], p[1]) for p in pts ]
+    lats = [ c.lat for c in coords ]
+    lons = [ c.long for c in coords ]
+    center = Coord((min(lats) + max(lats)) / 2, (min(lons) + max(lons)) / 2)
+
+    wps = 0
+    for p in pts:
+	if p[2]: wps = wps + 1
+
+    out = open(name, "w")
+    out.write("%.6f %.6f %d %d\n" % (center.lat, center.long, len(pts), wps))
+    for i in range(len(pts)):
+	x, y = toTM(coords[i], center, UTM_k0, Datum_WGS84)
+	if pts[i][2]:
+	    out.write("%d %d %s\n" % (x, y, pts[i][2]))
+	else:
+	    out.write("%d %d\n" % (x, y))
+    out.close()
+
+def write_drive(name, pts):
+    out = open(name, "w")
+    t = EPOCH
+    i = 0
+    pos = 0.0	    # distance along the current segment
+    detour = -1	    # seconds into a detour
+    stop = 0
+    seen = -1	    # last waypoint we passed
+
+    while i < len(pts) - 1:
+	x0, y0, desc, cls = pts[i]
+	x1, y1 = pts[i+1][0], pts[i+1][1]
+	seg = math.hypot(x1 - x0, y1 - y0)
+
+	if desc and cls == LOCAL and seen != i:
+	    seen = i
+	    if random.random() < 0.3: stop = 15
+	    if detour < 0 and random.random() < 0.05: detour = 0
+
+	if stop:
+	    stop = stop - 1
+	elif pos >= seg:
+	    pos = pos - seg
+	    i = i + 1
+	    continue
+	else:
+	    pos = pos + roadclass[pts[i+1][3]][1]
+
+	f = seg and min(pos, seg) / seg
+	x = x0 + (x1 - x0) * f + random.gauss(0.0, NOISE)
+	y = y0 + (y1 - y0) * f + random.gauss(0.0, NOISE)
+
+	# drive off to the side of the route and back
+	if detour >= 0:
+	    off = DETOUR * min(detour / 30.0, 1.0, (90 - detour) / 30.0)
+	    if seg:
+		x = x + off * (y1 - y0) / seg
+		y = y - off * (x1 - x0) / seg
+	    detour = detour + 1
+	    if detour > 90: detour = -1
+
+	c = to_coord(x, y)
+	out.write("T\t%s\t%.7f\t%.7f\n" % \
+	    (time.strftime("%m/%d/%Y %H:%M:%S", time.gmtime(t)), c.lat, c.long))
+	t = t + 1
+    out.close()
+
+points, waypoints, length, seed = 100000, 2000, 400.0, 1
+try:
+    opts, args = getopt.getopt(sys.argv[1:], "p:w:l:s:")
+except getopt.error:
+    args = []
+for o, v in opts:
+    if o == "-p": points = int(v)
+    if o == "-w": waypoints = int(v)
+    if o == "-l": length = float(v)
+    if o == "-s": seed = int(v)
+
+if len(args) != 2 or points < 2 or waypoints < 3:
+    print "Usage: %s [-p points] [-w waypoints] [-l km] [-s seed] <route> <track>" % sys.argv[0]
+    sys.exit(-1)
+
+random.seed(seed)
+pts = walk(make_roads(waypoints - 2, length * 1000.0), points - 1, length * 1000.0)
+write_route(args[0], pts)
+write_drive(args[1], pts)
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Relays the NMEA data stream to other local processes so they don't have to
+ * fight us over the serial port. Configured with relay=<port> for a TCP
+ * socket on the loopback device, or relay=<path> for a unix domain socket.
+ *
+ * Everything is appended to one ring buffer, and every client only keeps a
+ * cursor into that ring. Clients are written to straight from the ring, and
+ * any client that falls more than a ring's worth behind is dropped. Only the
+ * receiver thread calls these functions.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "gpsapp.h"
+
+#define RELAY_RING 8192 /* must be a power of two */
+#define RELAY_MAX_CLIENTS 8
+
+char *relayaddr = NULL;
+
+static int listenfd = -1;
+static char ring[RELAY_RING];
+static unsigned int head; /* total number of bytes written into the ring */
+
+static struct relay_client {
+    int fd;
+    unsigned int tail;    /* total number of bytes sent to this client */
+    int synced;		  /* we've seen the start of a sentence */
+} clients[RELAY_MAX_CLIENTS];
+static int nclients;
+
+int relay_open(void)
+{
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    struct sockaddr *sa;
+    int len, flag = 1;
+
+    if (!relayaddr || listenfd != -1)
+	return 0;
+
+    /* a client going away shouldn't take us down */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (relayaddr[0] == '/') {
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, relayaddr, sizeof(sun.sun_path) - 1);
+	unlink(sun.sun_path);
+	sa = (struct sockaddr *)&sun;
+	len = sizeof(sun);
+    } else {
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(atoi(relayaddr));
+	sa = (struct sockaddr *)&sin;
+	len = sizeof(sin);
+    }
+
+    listenfd = socket(sa->sa_family, SOCK_STREAM, 0);
+    if (listenfd == -1)
+	return -1;
+
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    fcntl(listenfd, F_SETFL, O_RDWR | O_NONBLOCK);
+
+    if (bind(listenfd, sa, len) == -1 || listen(listenfd, 4) == -1) {
+	close(listenfd);
+	listenfd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+static void relay_drop(int i)
+{
+    close(clients[i].fd);
+    clients[i] = clients[--nclients];
+}
+
+void relay_close(void)
+{
+    while (nclients)
+	relay_drop(0);
+
+    if (listenfd == -1)
+	return;
+
+    close(listenfd);
+    listenfd = -1;
+    if (relayaddr[0] == '/')
+	unlink(relayaddr);
+}
+
+/* push as much as the client will take without blocking, returns -1 when the
+ * client should be dropped */
+static int relay_flush(struct relay_client *c)
+{
+    unsigned int pending, off;
+    int n;
+
+    /* the NMEA passthrough isn't split into sentences, so a new client
+     * skips ahead to the first one that starts after it connected */
+    if (!c->synced && head - c->tail > RELAY_RING)
+	c->tail = head - RELAY_RING;
+    while (!c->synced && c->tail != head) {
+	if (ring[c->tail & (RELAY_RING - 1)] == '$')
+	    c->synced = 1;
+	else
+	    c->tail++;
+    }
+
+    while ((pending = head - c->tail) != 0) {
+	if (pending > RELAY_RING)
+	    return -1; /* too slow, we already overwrote its data */
+
+	off = c->tail & (RELAY_RING - 1);
+	if (pending > RELAY_RING - off)
+	    pending = RELAY_RING - off;
+
+	n = write(c->fd, &ring[off], pending);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	    break;
+	if (n <= 0)
+	    return -1;
+	c->tail += n;
+    }
+    return 0;
+}
+
+void relay_write(const char *buf, int len)
+{
+    unsigned int off;
+    int i, n;
+
+    if (!nclients)
+	return;
+
+    /* only the last RELAY_RING bytes matter */
+    if (len > RELAY_RING) {
+	head += len - RELAY_RING;
+	buf += len - RELAY_RING;
+	len = RELAY_RING;
+    }
+
+    while (len) {
+	off = head & (RELAY_RING - 1);
+	n = RELAY_RING - off;
+	if (n > len) n = len;
+
+	memcpy(&ring[off], buf, n);
+	head += n;
+	buf += n;
+	len -= n;
+    }
+
+    for (i = nclients - 1; i >= 0; i--)
+	if (relay_flush(&clients[i]) == -1)
+	    relay_drop(i);
+}
+
+/* add the relay's sockets to the receiver thread's select sets */
+int relay_fdset(fd_set *rfds, fd_set *wfds, int maxfd)
+{
+    int i;
+
+    if (listenfd == -1)
+	return maxfd;
+
+    FD_SET(listenfd, rfds);
+    if (listenfd > maxfd)
+	maxfd = listenfd;
+
+    for (i = 0; i < nclients; i++) {
+	/* we never expect to read anything, but this way we notice when the
+	 * client hangs up */
+	FD_SET(clients[i].fd, rfds);
+	if (head != clients[i].tail)
+	    FD_SET(clients[i].fd, wfds);
+	if (clients[i].fd > maxfd)
+	    maxfd = clients[i].fd;
+    }
+    return maxfd;
+}
+
+void relay_service(fd_set *rfds, fd_set *wfds)
+{
+    char buf[64];
+    int i, fd;
+
+    if (listenfd == -1)
+	return;
+
+    for (i = nclients - 1; i >= 0; i--) {
+	fd = clients[i].fd;
+	if (FD_ISSET(fd, rfds) && read(fd, buf, sizeof(buf)) <= 0)
+	    relay_drop(i);
+	else if (FD_ISSET(fd, wfds) && relay_flush(&clients[i]) == -1)
+	    relay_drop(i);
+    }
+
+    if (!FD_ISSET(listenfd, rfds))
+	return;
+
+    fd = accept(listenfd, NULL, NULL);
+    if (fd == -1)
+	return;
+
+    if (nclients == RELAY_MAX_CLIENTS) {
+	close(fd);
+	return;
+    }
+
+    fcntl(fd, F_SETFL, O_RDWR | O_NONBLOCK);
+    clients[nclients].fd = fd;
+    clients[nclients].synced = 0;
+    clients[nclients++].tail = head;
+}
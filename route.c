@@ -16,209 +16,603 @@
 #include <time.h>
 #include "gpsapp.h"
 #include "vfdlib.h"
+#include "metrics.h"
 
 /* coord_center is needed to project GPS coords into map coords */ 
 struct coord coord_center;
 int nextwp;
 time_t user_twiddle;
 
+/* the active route, only complete routes end up here */
+static struct route noroute;
+static struct route *route = &noroute;
+
 /* saved state variables after a successful locate */
-static struct route route;
 static int total_dist;
 static int minidx;
 
-#define ROUTE_DIR "programs0/routes"
-char *routedir = NULL;
-static int selected_route;
-static char **routes;
-static int nroutes;
+/* which waypoint's instruction is currently in route->live */
+static int live_wp = -1, live_turn, live_width[2];
+
+/* Whether we are still following the route. Every fix is compared against
+ * the segments on either side of the point route_locate found, it takes a
+ * couple of fixes in a row to change our mind, and getting back on the
+ * route needs us to be closer than leaving it did. */
+#define OFFROUTE_DIST	60	/* meters from the route before we left it */
+#define ONROUTE_DIST	30	/* and how close we have to get to be back */
+#define OFFROUTE_HDG	120	/* degrees, we're driving it the wrong way */
+#define ONROUTE_HDG	60
+#define OFFROUTE_FIXES	3
+#define OFFROUTE_SPEED	5000	/* m/h, we don't change our mind when slower */
+#define RELOCATE_FIXES	5	/* how often we look for the route while off */
+#define HDG_SPEED	20000	/* m/h, below that our heading is too noisy */
+
+static int offroute, off_fixes, relocate_fixes;
+static int xtrack, hdg_error;	/* of the last fix, hdg_error -1 if unknown */
+
+/* called when we leave the route and when we get back on it */
+void (*route_offroute_hook)(int off);
+
+/* classify the turn, '[continue|bear|turn] [sharply] [left|right]' */
+static int wp_turn(short inhdg, short outhdg)
+{
+    short turn = outhdg - inhdg;
+    int left = 0;
+
+    if (turn < -180) turn += 360;
+    if (turn >= 180) turn -= 360;
+
+    if (turn < 0) {
+	left = WP_LEFT;
+	turn = -turn;
+    }
+
+    if (turn <= 5)   return WP_CONTINUE;
+    if (turn <= 55)  return WP_BEAR | left;
+    if (turn <= 130) return WP_TURN | left;
+    return WP_SHARP | left;
+}
 
-static int qcmp(const void *a, const void *b)
+/* restore the full description, buf needs room for short_desc plus
+ * WP_DESC_EXTRA characters */
+#define WP_DESC_EXTRA 32
+static int wp_format(char *buf, const int turn, const char *short_desc)
 {
-    return strcasecmp(*(const char **)a, *(const char **)b);
+    char *heading = (turn & WP_LEFT) ? "LEFT" : "RIGHT";
+
+    switch (turn & ~WP_LEFT) {
+    case WP_START:
+	return sprintf(buf, "Start at %s", short_desc);
+    case WP_END:
+	return sprintf(buf, "End at %s", short_desc);
+    case WP_CONTINUE:
+	return sprintf(buf, "Continue onto %s", short_desc);
+    case WP_BEAR:
+	return sprintf(buf, "Bear %s onto %s", heading, short_desc);
+    case WP_TURN:
+	return sprintf(buf, "Turn %s onto %s", heading, short_desc);
+    default:
+	return sprintf(buf, "Turn sharply %s onto %s", heading, short_desc);
+    }
 }
 
-int routes_init(void)
+/* The points and waypoints of a route are carved out of a single block, sized
+ * from the counts in the header. The waypoint descriptions and instructions
+ * get a block of their own once we know how much room they take. */
+struct arena {
+    char *next, *end;
+};
+
+static void *arena_alloc(struct arena *a, size_t size, size_t align)
 {
-    DIR *dir;
-    struct dirent *entry;
-    int i;
+    char *p = (char *)(((unsigned long)a->next + align - 1) & ~(align - 1));
 
-    for (i = 0; i < nroutes; i++) free(routes[i]);
-    if (routes) free(routes);
-    routes = NULL;
-    nroutes = 0;
+    if (p > a->end || size > (size_t)(a->end - p))
+	return NULL;
 
-    dir = opendir(routedir?routedir:ROUTE_DIR);
-    if (!dir) return 0;
+    a->next = p + size;
+    return p;
+}
 
-    while ((entry = readdir(dir)) != NULL)
-	nroutes++;
+static char *arena_strdup(struct arena *a, const char *s)
+{
+    int len = strlen(s) + 1;
+    char *p = arena_alloc(a, len, 1);
 
-    routes = malloc(nroutes * sizeof(char *));
-    if (!routes) {
-	closedir(dir);
-	nroutes = 0;
-	return 0;
+    if (p) memcpy(p, s, len);
+    return p;
+}
+
+/* route that is being loaded in the background */
+#define LOAD_SLICE 20000 /* microseconds of loading per main loop iteration */
+enum { LOAD_POINTS, LOAD_DISTS, LOAD_FINISH };
+
+static struct route_loader {
+    FILE *f;
+    struct route *r;
+    int phase;
+    int npts, nwps, ndists; /* progress so far */
+    char *descs;	    /* short descriptions read so far */
+    int desclen, descroom;
+    char *msg;
+} *loader;
+
+/* keep the description of a waypoint until we have seen all of them */
+static int loader_desc(struct route_loader *l, const char *s)
+{
+    int len = strlen(s) + 1, room = l->descroom ? l->descroom : 4096;
+    char *p;
+
+    if (l->desclen + len > l->descroom) {
+	while (room < l->desclen + len)
+	    room *= 2;
+	p = realloc(l->descs, room);
+	if (!p) return -1;
+	l->descs = p;
+	l->descroom = room;
+    }
+    memcpy(l->descs + l->desclen, s, len);
+    l->desclen += len;
+    return 0;
+}
+
+/* which way the road goes into and out of every waypoint */
+static void route_headings(struct route *r)
+{
+    int i, idx;
+
+    for (i = 0; i < r->nwps; i++) {
+	idx = r->wps[i].idx;
+	if (idx > 0 && idx < r->npts-1) {
+	    r->wps[i].inhdg = radtodeg(bearing(&r->pts[idx-1], &r->pts[idx]));
+	    r->wps[i].outhdg = radtodeg(bearing(&r->pts[idx], &r->pts[idx+1]));
+	}
+    }
+}
+
+/* generate the turn instructions once, instead of on every redraw. The short
+ * descriptions are copied in front of them */
+static int route_describe(struct route *r)
+{
+    struct wp *wp;
+    int i, size = 0, maxlen = 0, len;
+    char *p;
+
+    for (i = 0; i < r->nwps; i++) {
+	len = strlen(r->wps[i].short_desc) + WP_DESC_EXTRA;
+	if (len > maxlen) maxlen = len;
+	size += strlen(r->wps[i].short_desc) + 1 + len;
     }
-    memset(routes, 0, nroutes * sizeof(char *));
+    if (!r->nwps)
+	return 0;
 
-    rewinddir(dir);
-    i = 0;
-    while (1) {
-	char buf[PATH_MAX];
-	struct stat s;
+    r->text = malloc(size + maxlen);
+    if (!r->text)
+	return -1;
+    r->live = r->text + size;
+    r->size += size + maxlen;
+
+    for (i = 0, p = r->text; i < r->nwps; i++) {
+	len = strlen(r->wps[i].short_desc) + 1;
+	memcpy(p, r->wps[i].short_desc, len);
+	r->wps[i].short_desc = p;
+	p += len;
+    }
 
-	entry = readdir(dir);
-	if (!entry) break;
+    for (i = 0; i < r->nwps; i++) {
+	wp = &r->wps[i];
 
-	strcpy(buf, routedir?routedir:ROUTE_DIR);
-	strcat(buf, "/");
-	strcat(buf, entry->d_name);
+	if (wp->idx == r->npts-1)  wp->turn = WP_END;
+	else if (wp->idx == 0)	   wp->turn = WP_START;
+	else wp->turn = wp_turn(wp->inhdg, wp->outhdg);
 
-	if (stat(buf, &s) == 0 && S_ISREG(s.st_mode))
-	    routes[i++] = strdup(entry->d_name);
-	else
-	    nroutes--; // we allocated a couple of pointers more than necessary.
+	wp->desc = p;
+	p += wp_format(p, wp->turn, wp->short_desc) + 1;
+	wp->width[0] = vfdlib_getTextWidth(wp->desc, 0);
+	wp->width[1] = vfdlib_getTextWidth(wp->desc, 1);
     }
-    closedir(dir);
+    return 0;
+}
 
-    /* sort the list alphabetically */
-    qsort(routes, nroutes, sizeof(char *), qcmp);
-    return 1;
+static void route_free(struct route *r)
+{
+    if (r == &noroute)
+	return;
+
+    if (r->arena)
+	free(r->arena);
+    if (r->text)
+	free(r->text);
+    free(r);
 }
 
-void routes_list(void)
+/* Recently used routes are kept around, so that switching between the way
+ * out and the way back doesn't mean loading and preparing them again. The
+ * list is in most recently used order, and is trimmed from the end when we
+ * go over budget. */
+#define ROUTE_CACHE_BUDGET (1024 * 1024)
+
+static struct route *cache;
+
+static void route_cache_put(struct route *r)
 {
-    if (!routes || !nroutes) {
-	draw_msg("No routes found");
+    struct route **pp, *old;
+    int size;
+
+    if (r == &noroute)
 	return;
+
+    /* computed on the fly, there is no file to find it by */
+    if (r->fsize < 0) {
+	route_free(r);
+	return;
+    }
+
+    r->next = cache;
+    cache = r;
+
+    /* always keep the one we just added, and whatever recently used routes
+     * still fit after it */
+    size = r->size;
+    for (pp = &cache->next; *pp; ) {
+	if (size + (*pp)->size > ROUTE_CACHE_BUDGET) {
+	    old = *pp;
+	    *pp = old->next;
+	    route_free(old);
+	} else {
+	    size += (*pp)->size;
+	    pp = &(*pp)->next;
+	}
+    }
+}
+
+static struct route *route_cache_get(const char *name, const struct stat *st)
+{
+    struct route **pp, *r;
+
+    for (pp = &cache; *pp; pp = &(*pp)->next) {
+	r = *pp;
+	if (strcmp(r->name, name) != 0)
+	    continue;
+
+	*pp = r->next;
+
+	/* changed since we loaded it */
+	if (r->fsize != st->st_size || r->mtime != st->st_mtime) {
+	    route_free(r);
+	    return NULL;
+	}
+	return r;
     }
-    draw_msg(routes[selected_route]);
+    return NULL;
+}
+
+/* the active route goes back into the cache */
+static void route_release(void)
+{
+    route_cache_put(route);
+    route = &noroute;
+    nextwp = minidx = 0;
+    live_wp = -1;
+    offroute = off_fixes = relocate_fixes = 0;
+    eta_free();
 }
 
-void route_select(int updown)
+/* the track and the filter are only valid as long as the center doesn't
+ * change, so keep them when we switch between routes in the same area */
+static void route_center(const struct coord *center)
 {
-    if (updown) selected_route++;
-    else        selected_route--;
+    if (center->lat == coord_center.lat && center->lon == coord_center.lon)
+	return;
 
-    if (selected_route >= nroutes) selected_route = 0;
-    else if (selected_route < 0)   selected_route = nroutes-1;
+    coord_center = *center;
+    track_init();
+    filter_reset();
 }
 
+static void route_activate(struct route *r)
+{
+    route = r;
+    route_center(&r->center);
+    eta_load(r->name, r);
+}
+
+static void route_cancel(void)
+{
+    if (!loader) return;
+
+    fclose(loader->f);
+    route_free(loader->r);
+    if (loader->descs)
+	free(loader->descs);
+    free(loader);
+    loader = NULL;
+}
+
+/* Loading happens a slice at a time from the main loop, so that we keep
+ * processing fixes and the points can be drawn as they come in. The route
+ * only becomes the active route once everything has been computed. */
 void route_load(void)
 {
-    char buf[PATH_MAX], *p;
+    struct route_info *info = routes_selected();
+    char buf[PATH_MAX], *p, *msg = NULL;
+    struct route *r;
+    struct arena a;
+    struct stat st;
     FILE *f;
-    int i, j, len;
     
-    if (!routes || selected_route < 0 || selected_route >= nroutes)
+    if (!info) return;
+
+    route_path(buf, info->name);
+    if (stat(buf, &st) == -1)
 	return;
 
-    strcpy(buf, routedir?routedir:ROUTE_DIR);
-    strcat(buf, "/");
-    strcat(buf, routes[selected_route]);
+    /* changed without touching the directory */
+    if (st.st_size != info->size || st.st_mtime != info->mtime)
+	routes_stale();
 
-    for (i = 0; i < nroutes; i++)
-	free(routes[i]);
-    free(routes);
-    routes = NULL;
-    nroutes = 0;
+    route_cancel();
+
+    r = route_cache_get(info->name, &st);
+    if (r) {
+	route_release();
+	route_activate(r);
+	return;
+    }
 
     f = fopen(buf, "r");
     if (!f) return;
 
-    route_init();
+    route_release();
 
-    draw_clear();
-    draw_msg("Loading");
-    draw_display();
+    loader = calloc(1, sizeof(*loader));
+    r = calloc(1, sizeof(*r));
+    if (!loader || !r) {
+	if (loader) free(loader);
+	if (r) free(r);
+	loader = NULL;
+	fclose(f);
+	err("Failed allocation for route");
+	return;
+    }
+    loader->f = f;
+    loader->r = r;
+
+    if (fstat(fileno(f), &st) == -1 || !fgets(buf, PATH_MAX, f))
+	goto fail;
+
+    p = buf;
+    r->center.lat = degtorad(strtod(p, &p));
+    r->center.lon = degtorad(strtod(p, &p));
+    r->npts = strtol(p, &p, 10);
+    r->nwps = strtol(p, &p, 10);
+
+    if (r->npts <= 0 || r->nwps < 0 || r->npts > st.st_size ||
+	r->nwps > r->npts)
+	goto fail;
+
+    /* the partially loaded route is drawn relative to its own center */
+    route_center(&r->center);
+    r->fsize = st.st_size;
+    r->mtime = st.st_mtime;
+
+    r->size = r->npts * (sizeof(struct xy) + sizeof(int)) +
+	      r->nwps * sizeof(struct wp) + 2 * sizeof(long) +
+	      strlen(info->name) + 1;
+
+    r->arena = malloc(r->size);
+    if (!r->arena) {
+	msg = "Failed allocation for route";
+	goto fail;
+    }
+    a.next = r->arena;
+    a.end = r->arena + r->size;
 
-    fgets(buf, PATH_MAX, f); p = buf;
-    coord_center.lat = degtorad(strtod(p, &p));
-    coord_center.lon = degtorad(strtod(p, &p));
-    route.npts = strtol(p, &p, 10);
-    route.nwps = strtol(p, &p, 10);
+    r->pts = arena_alloc(&a, r->npts * sizeof(struct xy), sizeof(long));
+    r->dists = arena_alloc(&a, r->npts * sizeof(int), sizeof(long));
+    r->wps = arena_alloc(&a, r->nwps * sizeof(struct wp), sizeof(long));
+    r->name = arena_strdup(&a, info->name);
+    loader->phase = LOAD_POINTS;
+    return;
 
-    if (!route.npts) goto done;
+fail:
+    route_init();
+    if (msg) err(msg);
+}
 
-    route.pts = malloc(route.npts * sizeof(struct coord));
-    route.dists = malloc(route.npts * sizeof(int));
-    route.wps = malloc(route.nwps * sizeof(struct wp));
-    /* malloc's don't fail right :) */
-    if (!route.pts || !route.dists || !route.wps) {
-	err("Failed allocation for route");
-	if (route.pts) free(route.pts);
-	if (route.dists) free(route.dists);
-	if (route.wps) free(route.wps);
-	route.pts = NULL; route.dists = NULL; route.wps = NULL;
-	route.npts = route.nwps = 0;
-	fclose(f);
-	goto done;
-    }
+/* one step of loading the route, returns 0 when done and -1 on errors */
+static int route_load_step(struct route_loader *l)
+{
+    struct route *r = l->r;
+    char buf[PATH_MAX], *p;
+    int i, len;
 
-    for (i = 0, j = 0; i < route.npts; i++) {
-	fgets(buf, PATH_MAX, f); p = buf;
+    switch (l->phase) {
+    case LOAD_POINTS:
+	if (!fgets(buf, PATH_MAX, l->f)) {
+	    l->msg = "Truncated route";
+	    return -1;
+	}
+	i = l->npts;
+	p = buf;
 	len = strlen(buf);
-	if (buf[len-1] == '\n') buf[--len] = '\0';
-	if (buf[len-1] == '\r') buf[--len] = '\0';
-	if (buf[len-1] == ' ') buf[--len] = '\0';
-	route.pts[i].x = strtol(p, &p, 10);
-	route.pts[i].y = strtol(p, &p, 10);
+	if (len && buf[len-1] == '\n') buf[--len] = '\0';
+	if (len && buf[len-1] == '\r') buf[--len] = '\0';
+	if (len && buf[len-1] == ' ') buf[--len] = '\0';
+	r->pts[i].x = strtol(p, &p, 10);
+	r->pts[i].y = strtol(p, &p, 10);
 	if (p < buf + len) {
-	    if (j == route.nwps) {
-		err("Too many waypoints?");
-		for (i = 0; i < j; i++)
-		    free(route.wps[i].short_desc);
-		free(route.pts); free(route.dists); free(route.wps);
-		route.pts = NULL; route.dists = NULL; route.wps = NULL;
-		route.npts = route.nwps = 0;
-		goto done;
+	    if (l->nwps == r->nwps) {
+		l->msg = "Too many waypoints?";
+		return -1;
 	    }
-	    route.wps[j].idx = i;
-	    route.wps[j++].short_desc = strdup(p+1);
+	    r->wps[l->nwps++].idx = i;
+	    if (loader_desc(l, p+1) == -1) {
+		l->msg = "Failed allocation for route";
+		return -1;
+	    }
+	}
+	if (++l->npts == r->npts) {
+	    r->nwps = l->nwps;
+	    r->dists[r->npts-1] = 0;
+	    l->phase = LOAD_DISTS;
+	}
+	return 1;
+
+    case LOAD_DISTS:
+	/* now calculate the distances, backwards from the end */
+	i = r->npts - 1 - l->ndists;
+	if (i > 0)
+	    r->dists[i-1] = r->dists[i] +
+		sqrt(distance2(&r->pts[i-1], &r->pts[i]));
+	if (++l->ndists >= r->npts)
+	    l->phase = LOAD_FINISH;
+	return 1;
+
+    case LOAD_FINISH:
+	route_headings(r);
+	for (i = 0, p = l->descs; i < r->nwps; i++, p += strlen(p) + 1)
+	    r->wps[i].short_desc = p;
+	if (route_describe(r) == -1) {
+	    l->msg = "Failed allocation for route";
+	    return -1;
 	}
+	return 0;
     }
+    return -1;
+}
 
-    draw_clear();
-    draw_msg("Pre-computing values");
-    draw_display();
-
-    /* now calculate the distances */
-    route.dists[route.npts-1] = 0;
-    for (i = route.npts-2; i >= 0; i--)
-	route.dists[i] = route.dists[i+1] + 
-	    sqrt(distance2(&route.pts[i], &route.pts[i+1]));
-
-    for (i = 0; i < route.nwps; i++) {
-	int idx = route.wps[i].idx;
-	if (idx > 0 && idx < route.npts-1) {
-	    route.wps[i].inhdg = radtodeg(bearing(&route.pts[idx-1], &route.pts[idx]));
-	    route.wps[i].outhdg = radtodeg(bearing(&route.pts[idx], &route.pts[idx+1]));
-	}
+/* load some more of the route, returns 1 while there is more to do */
+int route_poll(void)
+{
+    struct timeval start, now, diff;
+    char *msg;
+    int n = 0, rc;
+
+    if (!loader) return 0;
+
+    gettimeofday(&start, NULL);
+    while ((rc = route_load_step(loader)) == 1) {
+	if (++n % 64) continue;
+
+	gettimeofday(&now, NULL);
+	timesub(&diff, &now, &start);
+	if (diff.tv_sec || diff.tv_usec >= LOAD_SLICE)
+	    break;
     }
 
-done:
-    fclose(f);
+    /* show the points we have so far */
+    do_refresh = 1;
+
+    if (rc == 1)
+	return 1;
+
+    if (rc == -1) {
+	msg = loader->msg;
+	route_init();
+	if (msg) err(msg);
+	return 0;
+    }
+
+    /* done, switch over to the new route */
+    route_activate(loader->r);
+    loader->r = &noroute;
+    route_cancel();
+    return 0;
 }
 
-void route_init(void)
+/* Switch to a route that wasn't loaded from a file, like the ones found by
+ * the router. The points are in the current map grid, and everything is
+ * copied into the new route. */
+int route_replace(const struct xy *pts, int npts, const struct wp *wps,
+		  int nwps)
 {
+    struct route *r;
+    struct arena a;
     int i;
 
-    for (i = 0; i < route.nwps; i++)
-	if (route.wps[i].short_desc)
-	    free(route.wps[i].short_desc);
+    if (npts <= 0)
+	return -1;
 
-    if (route.nwps)
-	free(route.wps);
+    r = calloc(1, sizeof(*r));
+    if (!r) return -1;
 
-    if (route.pts) {
-	free(route.pts);
-	free(route.dists);
+    r->npts = npts;
+    r->nwps = nwps;
+    r->size = npts * (sizeof(struct xy) + sizeof(int)) +
+	      nwps * sizeof(struct wp) + 2 * sizeof(long);
+    r->arena = malloc(r->size);
+    if (!r->arena) {
+	free(r);
+	return -1;
     }
+    a.next = r->arena;
+    a.end = r->arena + r->size;
+
+    r->pts = arena_alloc(&a, npts * sizeof(struct xy), sizeof(long));
+    r->dists = arena_alloc(&a, npts * sizeof(int), sizeof(long));
+    r->wps = arena_alloc(&a, nwps * sizeof(struct wp), sizeof(long));
+    memcpy(r->pts, pts, npts * sizeof(struct xy));
+    for (i = 0; i < nwps; i++) {
+	r->wps[i].idx = wps[i].idx;
+	r->wps[i].short_desc = wps[i].short_desc;
+    }
+
+    r->dists[npts-1] = 0;
+    for (i = npts - 1; i > 0; i--)
+	r->dists[i-1] = r->dists[i] + sqrt(distance2(&pts[i-1], &pts[i]));
+
+    route_headings(r);
+    if (route_describe(r) == -1) {
+	route_free(r);
+	return -1;
+    }
+
+    r->fsize = -1;
+    r->center = coord_center;
+
+    route_cancel();
+    route_release();
+    route_activate(r);
+    return 0;
+}
+
+/* where the active route ends, and the name of that waypoint when there is
+ * one, returns 0 when there is no route */
+int route_dest(struct xy *pos, const char **name)
+{
+    if (!route->npts)
+	return 0;
+
+    *pos = route->pts[route->npts-1];
+    *name = NULL;
+    if (route->nwps && route->wps[route->nwps-1].idx == route->npts-1)
+	*name = route->wps[route->nwps-1].short_desc;
+    return 1;
+}
+
+/* the points of the route we haven't driven yet, returns how many */
+int route_ahead(const struct xy **pts)
+{
+    if (!route->npts)
+	return 0;
+
+    *pts = &route->pts[minidx];
+    return route->npts - minidx;
+}
+
+/* percentage of the route that has been loaded, -1 when we're not loading */
+int route_loading(void)
+{
+    if (!loader) return -1;
+    if (!loader->r->npts) return 0;
+    return (loader->npts + loader->ndists) * 50 / loader->r->npts;
+}
 
-    route.npts = route.nwps = 0;
+void route_init(void)
+{
+    route_cancel();
+    route_release();
 
     /* recenter around current GPS position */
     coord_center.lat = coord_center.lon = 0.0;
@@ -226,49 +620,170 @@ void route_init(void)
     /* Any previously logged points are based on the wrong center
      * coordinate. */
     track_init();
+    filter_reset();
 }
 
 void route_recenter(void)
 {
-    if (!route.npts && coord_center.lat == 0.0 && coord_center.lon == 0.0)
+    if (!route->npts && coord_center.lat == 0.0 && coord_center.lon == 0.0) {
 	coord_center = gps_coord;
+	filter_reset();
+    }
 }
 
 
 void route_update_vmg(void)
 {
-    double vmg_east, vmg_north, b;
-    int idx, vmg = 0;
-
-    if (nextwp >= route.nwps) return;
-
-    idx = route.wps[nextwp].idx;
-    /* calculate actual velocity towards the target wp */
-    b = bearing(&gps_coord.xy, &route.pts[idx]);
+    if (nextwp >= route->nwps) return;
 
-    vmg_east = sin(b) * gps_state.spd_east;
-    vmg_north = cos(b) * gps_state.spd_north;
-
-    vmg = sqrt(vmg_east * vmg_east + vmg_north * vmg_north) * 3600.0;
-    gps_avgvmg += vmg - (gps_avgvmg >> AVGVMG_SHIFT);
-
-#ifndef __arm__
-    fprintf(stderr, "vmg %f\n", (gps_avgvmg >> AVGVMG_SHIFT) / 1609.344);
-#endif
+    eta_update(nextwp, filter_speed());
 }
 
 void route_skipwp(int dir)
 {
     user_twiddle = time(NULL);
+    eta_skip();
     nextwp += dir;
 
-    if (nextwp >= route.nwps)
-	nextwp = route.nwps-1;
+    if (nextwp >= route->nwps)
+	nextwp = route->nwps-1;
     if (nextwp < 0)
 	nextwp = 0;
 
-    if (nextwp < route.nwps)
-	minidx = route.wps[nextwp].idx;
+    if (nextwp < route->nwps)
+	minidx = route->wps[nextwp].idx;
+}
+
+/* distance from p to the segment a-b */
+static int segment_dist(const struct xy *p, const struct xy *a,
+			const struct xy *b)
+{
+    double dx = b->x - a->x, dy = b->y - a->y, len2 = dx * dx + dy * dy, t;
+
+    t = len2 ? ((p->x - a->x) * dx + (p->y - a->y) * dy) / len2 : 0.0;
+    if (t < 0.0) t = 0.0;
+    if (t > 1.0) t = 1.0;
+    return hypot(a->x + t * dx - p->x, a->y + t * dy - p->y);
+}
+
+/* how far our heading is off from the segment a-b, -1 when we don't know */
+static int segment_hdg(const struct xy *a, const struct xy *b)
+{
+    int d;
+
+    if (gps_bearing == -1 || filter_speed() < HDG_SPEED)
+	return -1;
+
+    d = abs((int)radtodeg(bearing(a, b)) - gps_bearing) % 360;
+    return d > 180 ? 360 - d : d;
+}
+
+/* look at the whole route for a segment we're on, in case we skipped part of
+ * it or came back on it further along. The route may cross itself, so we
+ * start where we left it and take the first stretch that fits.
+ * Returns 1 when we found one */
+static int route_relocate(void)
+{
+    int i, n, d, hdg, best = -1, bestidx = 0;
+
+    i = minidx > 0 ? minidx - 1 : 0;
+    for (n = 0; n < route->npts - 1; n++, i++) {
+	if (i >= route->npts - 1)
+	    i = 0;
+	d = segment_dist(&gps_coord.xy, &route->pts[i], &route->pts[i+1]);
+	hdg = segment_hdg(&route->pts[i], &route->pts[i+1]);
+	if (d > ONROUTE_DIST || hdg > ONROUTE_HDG) {
+	    if (best != -1)
+		break;
+	    continue;
+	}
+	if (best == -1 || d < best) {
+	    best = d;
+	    bestidx = i + 1;
+	}
+    }
+    if (best == -1)
+	return 0;
+
+    xtrack = best;
+    hdg_error = segment_hdg(&route->pts[bestidx-1], &route->pts[bestidx]);
+    minidx = bestidx;
+    for (nextwp = 0; nextwp < route->nwps; nextwp++)
+	if (minidx <= route->wps[nextwp].idx)
+	    break;
+    total_dist = sqrt((double)distance2(&gps_coord.xy, &route->pts[minidx])) +
+		 route->dists[minidx];
+    return 1;
+}
+
+static void route_offroute_changed(int off)
+{
+    offroute = off;
+    relocate_fixes = 0;
+    if (off) METRIC_COUNT(C_OFFROUTE);
+    if (route_offroute_hook)
+	route_offroute_hook(off);
+}
+
+/* compare the fix with the part of the route we matched it to, this is only
+ * a couple of segments so it doesn't matter how long the route is */
+static void route_corridor(void)
+{
+    int i, d, off;
+
+    xtrack = -1;
+    hdg_error = -1;
+    for (i = minidx - 1; i <= minidx; i++) {
+	if (i < 0 || i >= route->npts - 1)
+	    continue;
+	d = segment_dist(&gps_coord.xy, &route->pts[i], &route->pts[i+1]);
+	if (xtrack != -1 && d >= xtrack)
+	    continue;
+	xtrack = d;
+	hdg_error = segment_hdg(&route->pts[i], &route->pts[i+1]);
+    }
+    /* a route of just one point */
+    if (xtrack == -1)
+	xtrack = sqrt((double)distance2(&gps_coord.xy, &route->pts[0]));
+
+    if (filter_speed() < OFFROUTE_SPEED)
+	return;
+
+    if (offroute)
+	off = xtrack > ONROUTE_DIST || hdg_error > ONROUTE_HDG;
+    else
+	off = xtrack > OFFROUTE_DIST || hdg_error > OFFROUTE_HDG;
+
+    /* route_locate keeps looking at the leg we left, so every couple of
+     * fixes look at all of the route to see if we got back on it. The
+     * next fixes have to agree before we believe it, the route may just
+     * cross the road we're on */
+    if (offroute && off && ++relocate_fixes >= RELOCATE_FIXES) {
+	relocate_fixes = 0;
+	off = !route_relocate();
+    }
+
+    if (off == offroute) {
+	off_fixes = 0;
+	return;
+    }
+    if (++off_fixes < OFFROUTE_FIXES)
+	return;
+    off_fixes = 0;
+
+    /* maybe we're on another part of the route */
+    if (off && route_relocate())
+	return;
+
+    route_offroute_changed(off);
+}
+
+/* how many meters we are off the route, 0 while we're following it. Driving
+ * it the wrong way counts as at least a meter off */
+int route_offroute(void)
+{
+    if (!offroute) return 0;
+    return xtrack > 0 ? xtrack : 1;
 }
 
 void route_locate(void)
@@ -276,7 +791,7 @@ void route_locate(void)
     int idx;
     long long mindist, dist;
 
-    if (!route.nwps) return;
+    if (!route->nwps) return;
 
     /* don't restart routing until about 10 seconds after the user has stopped
      * twiddling the knob to change the currently selected waypoint */
@@ -284,14 +799,14 @@ void route_locate(void)
 	return;
 
     /* don't try to be smart, just search based on the current nextwp */
-    if (nextwp >= route.nwps)
+    if (nextwp >= route->nwps)
 	nextwp = 0;
 
-    minidx = (nextwp > 1) ? route.wps[nextwp-1].idx + 1 : 0;
-    mindist = distance2(&gps_coord.xy, &route.pts[minidx]);
+    minidx = (nextwp > 1) ? route->wps[nextwp-1].idx + 1 : 0;
+    mindist = distance2(&gps_coord.xy, &route->pts[minidx]);
 
-    for (idx = minidx+1; idx <= route.wps[nextwp].idx; idx++) {
-	dist = distance2(&gps_coord.xy, &route.pts[idx]);
+    for (idx = minidx+1; idx <= route->wps[nextwp].idx; idx++) {
+	dist = distance2(&gps_coord.xy, &route->pts[idx]);
 	if (dist < mindist) {
 	    minidx = idx;
 	    mindist = dist;
@@ -300,33 +815,63 @@ void route_locate(void)
 
     /* ok we're really close now,
      * are there any points after the current one? */
-    if (minidx < route.npts - 2) {
+    if (minidx < route->npts - 2) {
 	/* and are we moving away from the point we just found? */
-	if (!towards(&gps_coord.xy, &route.pts[minidx], gps_bearing)) {
+	if (!towards(&gps_coord.xy, &route->pts[minidx], gps_bearing)) {
 	    minidx++;
-	    mindist = distance2(&gps_coord.xy, &route.pts[minidx]);
+	    mindist = distance2(&gps_coord.xy, &route->pts[minidx]);
 	}
     }
 
-    for (nextwp = 0; nextwp < route.nwps; nextwp++)
-	if (minidx <= route.wps[nextwp].idx)
+    for (nextwp = 0; nextwp < route->nwps; nextwp++)
+	if (minidx <= route->wps[nextwp].idx)
 	    break;
 
     /* got it! */
-    total_dist = sqrt((double)mindist) + route.dists[minidx];
+    total_dist = sqrt((double)mindist) + route->dists[minidx];
+
+    route_corridor();
 }
 
 void route_draw(struct xy *cur_pos)
 {
-    if (nextwp < route.nwps) {
-	int nextidx = route.wps[nextwp].idx;
-	draw_lines(route.pts, minidx+1, VFDSHADE_MEDIUM);
-	draw_line(cur_pos, &route.pts[minidx], VFDSHADE_BRIGHT);
+    /* whatever part of the route we're loading has been read so far */
+    if (loader) {
+	draw_lines(loader->r->pts, loader->npts, VFDSHADE_MEDIUM);
+	return;
+    }
+
+    if (nextwp < route->nwps) {
+	int nextidx = route->wps[nextwp].idx;
+	draw_lines(route->pts, minidx+1, VFDSHADE_MEDIUM);
+	draw_line(cur_pos, &route->pts[minidx], VFDSHADE_BRIGHT);
 	if (nextidx != minidx)
-	    draw_lines(&route.pts[minidx], (nextidx-minidx)+1, VFDSHADE_BRIGHT);
-	draw_lines(&route.pts[nextidx], route.npts - nextidx, VFDSHADE_MEDIUM);
+	    draw_lines(&route->pts[minidx], (nextidx-minidx)+1, VFDSHADE_BRIGHT);
+	draw_lines(&route->pts[nextidx], route->npts - nextidx, VFDSHADE_MEDIUM);
     } else
-	draw_lines(route.pts, route.npts, VFDSHADE_MEDIUM);
+	draw_lines(route->pts, route->npts, VFDSHADE_MEDIUM);
+}
+
+/* the instruction for the waypoint we're heading for depends on the direction
+ * we're approaching it from, all others are known when the route is loaded */
+static char *wp_desc(const int wpidx)
+{
+    struct wp *wp = &route->wps[wpidx];
+    int turn;
+
+    if (wp->idx != minidx || wp->turn == WP_START || wp->turn == WP_END)
+	return wp->desc;
+
+    //inhdg = bearing(&gps_coord.xy, &route->pts[idx]);
+    turn = wp_turn(gps_bearing, wp->outhdg);
+    if (wpidx != live_wp || turn != live_turn) {
+	wp_format(route->live, turn, wp->short_desc);
+	live_width[0] = vfdlib_getTextWidth(route->live, 0);
+	live_width[1] = vfdlib_getTextWidth(route->live, 1);
+	live_wp = wpidx;
+	live_turn = turn;
+    }
+    return route->live;
 }
 
 int route_getwp(const int wp, struct xy *pos, unsigned int *dist, char **desc)
@@ -334,71 +879,38 @@ int route_getwp(const int wp, struct xy *pos, unsigned int *dist, char **desc)
     int idx, wpidx;
 
     if (wp == -1)
-	wpidx = route.nwps - 1;
+	wpidx = route->nwps - 1;
     else
 	wpidx = wp;
 
-    if (wpidx < 0 || wpidx >= route.nwps)
+    if (wpidx < 0 || wpidx >= route->nwps)
 	return 0;
 
     if (pos) {
-	idx = route.wps[wpidx].idx;
-	*pos = route.pts[idx];
+	idx = route->wps[wpidx].idx;
+	*pos = route->pts[idx];
     }
 
     if (dist) {
-	idx = route.wps[wpidx].idx;
-	*dist = abs(total_dist - route.dists[idx]);
+	idx = route->wps[wpidx].idx;
+	*dist = abs(total_dist - route->dists[idx]);
     }
 
-    if (desc) {
-	static char buf[80];
-	char *short_desc;
-
-	/* Restore the full description,
-	 * '[continue|bear|turn] [sharply] [left|right] onto foo' */
-	idx = route.wps[wpidx].idx;
-	short_desc = route.wps[wpidx].short_desc;
-
-	if (idx == route.npts-1)
-	    sprintf(buf, "End at %s", short_desc);
-	else if (idx == 0)
-	    sprintf(buf, "Start at %s", short_desc);
-	else
-	{
-	    short inhdg, outhdg, turn;
-	    char *heading, *strong;
-
-	    if (idx == minidx)
-		//inhdg = bearing(&gps_coord.xy, &route.pts[idx]);
-		inhdg = gps_bearing;
-	    else
-		inhdg = route.wps[wpidx].inhdg;
-
-	    outhdg = route.wps[wpidx].outhdg;
-	    turn = outhdg - inhdg;
-	    if (turn < -180) turn += 360;
-	    if (turn >= 180) turn -= 360;
-
-	    if (turn < 0.0) {
-		heading = "LEFT";
-		turn = -turn;
-	    } else
-		heading = "RIGHT";
-
-	    strong = turn > 130 ? "sharply " : "";
-
-	    if (turn <= 5)
-		sprintf(buf, "Continue onto %s", short_desc);
-	    else if (turn <= 55)
-		sprintf(buf, "Bear %s onto %s", heading, short_desc);
-	    else
-		sprintf(buf, "Turn %s%s onto %s", strong, heading, short_desc);
-	}
-
-	*desc = buf;
-    }
+    if (desc)
+	*desc = wp_desc(wpidx);
 
     return 1;
 }
 
+/* pixel width of the waypoint's instruction */
+int route_getwidth(const int wp, const int font)
+{
+    int wpidx = (wp == -1) ? route->nwps - 1 : wp;
+
+    if (wpidx < 0 || wpidx >= route->nwps)
+	return 0;
+
+    if (wp_desc(wpidx) == route->live)
+	return live_width[font];
+    return route->wps[wpidx].width[font];
+}
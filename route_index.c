@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Index of the route directory, kept in statedir so that we don't have to
+ * look at every route file whenever the Load Route menu is opened. Besides
+ * the names it holds the size and modification time of every route, the
+ * center coordinate, the bounding box and the start and end points with
+ * their descriptions.
+ *
+ * The index is trusted as long as the modification time of the directory
+ * hasn't changed. When it has, only routes that are new or whose size or
+ * modification time differ are read again. The index is a text file with one
+ * line per route,
+ *   size mtime lat lon minx miny maxx maxy startx starty endx endy\tname\tstart\tend
+ *
+ * When we have a fix, the routes closest to where we are are listed before
+ * all routes in alphabetical order.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "gpsapp.h"
+
+#define ROUTE_DIR "programs0/routes"
+#define INDEX_FILE "routes.idx"
+#define INDEX_MAGIC "gpsapp-routes 1"
+#define INDEX_DESC 80 /* longest start/end description we keep */
+#define NEAREST 3     /* number of nearby routes listed first */
+#define NEAREST_MAX 100000 /* meters, don't bother with routes further away */
+#define EARTH_RADIUS 6378137.0
+
+char *routedir = NULL;
+
+static char *index_buf;		/* all strings point into this buffer */
+static int index_len, index_size;
+static time_t index_mtime;	/* of the route directory */
+static int index_stale;
+
+struct route_info *routes;
+int nroutes;
+static int selected_route;
+
+/* the menu lists the nearest routes first, followed by all routes */
+static int nearest[NEAREST], nearest_dist[NEAREST], nnearest;
+
+static struct route_info *route_entry(int i)
+{
+    return (i < nnearest) ? &routes[nearest[i]] : &routes[i - nnearest];
+}
+
+static char *route_dir(void)
+{
+    return routedir ? routedir : ROUTE_DIR;
+}
+
+char *route_path(char *buf, const char *name)
+{
+    snprintf(buf, PATH_MAX, "%s/%s", route_dir(), name);
+    return buf;
+}
+
+static int qcmp(const void *a, const void *b)
+{
+    return strcasecmp(((const struct route_info *)a)->name,
+		      ((const struct route_info *)b)->name);
+}
+
+/* find a route by name in the (sorted) index */
+static struct route_info *index_lookup(struct route_info *r, int n,
+				       const char *name)
+{
+    struct route_info key;
+
+    if (!r) return NULL;
+    key.name = (char *)name;
+    return bsearch(&key, r, n, sizeof(struct route_info), qcmp);
+}
+
+/* split the lines in index_buf into the routes array */
+static int index_parse(void)
+{
+    struct route_info *r;
+    char *p, *next, *f[4];
+    int i, n = 0;
+
+    for (p = index_buf; p < index_buf + index_len; p++)
+	if (*p == '\n') n++;
+
+    if (routes) free(routes);
+    routes = calloc(n ? n : 1, sizeof(struct route_info));
+    nroutes = 0;
+    if (!routes) return -1;
+
+    for (p = index_buf; p < index_buf + index_len; p = next) {
+	next = strchr(p, '\n');
+	if (!next) break;
+	*next++ = '\0';
+
+	/* numbers and the 3 tab separated strings */
+	f[0] = p;
+	for (i = 1; i < 4; i++) {
+	    f[i] = f[i-1] ? strchr(f[i-1], '\t') : NULL;
+	    if (f[i]) *f[i]++ = '\0';
+	}
+	if (!f[3]) continue;
+
+	r = &routes[nroutes];
+	if (sscanf(f[0], "%ld %ld %lf %lf %d %d %d %d %d %d %d %d",
+		   &r->size, &r->mtime, &r->center.lat, &r->center.lon,
+		   &r->min.x, &r->min.y, &r->max.x, &r->max.y,
+		   &r->start.x, &r->start.y, &r->end.x, &r->end.y) != 12)
+	    continue;
+
+	r->name = f[1];
+	r->start_desc = f[2];
+	r->end_desc = f[3];
+	nroutes++;
+    }
+
+    qsort(routes, nroutes, sizeof(struct route_info), qcmp);
+    return 0;
+}
+
+static int index_append(char **buf, int *len, int *size, const char *line)
+{
+    int n = strlen(line);
+    char *tmp;
+
+    if (*len + n + 1 > *size) {
+	int newsize = *size ? *size * 2 : 4096;
+	while (newsize < *len + n + 1) newsize *= 2;
+	tmp = realloc(*buf, newsize);
+	if (!tmp) return -1;
+	*buf = tmp;
+	*size = newsize;
+    }
+    memcpy(*buf + *len, line, n + 1);
+    *len += n;
+    return 0;
+}
+
+/* tabs and newlines would break the index */
+static void index_clean(char *dst, const char *src)
+{
+    int i;
+
+    for (i = 0; src[i] && i < INDEX_DESC - 1; i++)
+	dst[i] = (src[i] == '\t' || src[i] == '\n' || src[i] == '\r') ?
+		 ' ' : src[i];
+    dst[i] = '\0';
+}
+
+/* read a route file for the information we keep in the index */
+static int index_scan(const char *path, struct route_info *r)
+{
+    char buf[PATH_MAX], *p;
+    FILE *f;
+    int i, npts, len;
+
+    f = fopen(path, "r");
+    if (!f) return -1;
+
+    if (!fgets(buf, PATH_MAX, f)) {
+	fclose(f);
+	return -1;
+    }
+    p = buf;
+    r->center.lat = degtorad(strtod(p, &p));
+    r->center.lon = degtorad(strtod(p, &p));
+    npts = strtol(p, &p, 10);
+
+    r->start_desc[0] = r->end_desc[0] = '\0';
+    for (i = 0; i < npts && fgets(buf, PATH_MAX, f); i++) {
+	struct xy pt;
+
+	p = buf;
+	len = strlen(buf);
+	while (len && (buf[len-1] == '\n' || buf[len-1] == '\r' ||
+		       buf[len-1] == ' '))
+	    buf[--len] = '\0';
+	pt.x = strtol(p, &p, 10);
+	pt.y = strtol(p, &p, 10);
+
+	if (i == 0) {
+	    r->min = r->max = r->start = pt;
+	} else {
+	    if (pt.x < r->min.x) r->min.x = pt.x;
+	    if (pt.y < r->min.y) r->min.y = pt.y;
+	    if (pt.x > r->max.x) r->max.x = pt.x;
+	    if (pt.y > r->max.y) r->max.y = pt.y;
+	}
+	r->end = pt;
+
+	if (p < buf + len) {
+	    if (!r->start_desc[0])
+		index_clean(r->start_desc, p+1);
+	    index_clean(r->end_desc, p+1);
+	}
+    }
+    fclose(f);
+    return i ? 0 : -1;
+}
+
+static void index_write(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    FILE *f;
+
+    state_path(path, INDEX_FILE);
+    sprintf(tmp, "%s.new", path);
+
+    /* silently give up when the state directory isn't writable */
+    f = fopen(tmp, "w");
+    if (!f) return;
+
+    fprintf(f, "%s %ld\t%s\n", INDEX_MAGIC, (long)index_mtime, route_dir());
+    fwrite(index_buf, index_len, 1, f);
+    if (fclose(f) == 0)
+	rename(tmp, path);
+    else
+	unlink(tmp);
+}
+
+/* read the index from statedir, returns 1 when it matches the directory */
+static int index_read(time_t mtime)
+{
+    char path[PATH_MAX], hdr[PATH_MAX + 64], *p;
+    struct stat st;
+    FILE *f;
+    int valid;
+
+    f = fopen(state_path(path, INDEX_FILE), "r");
+    if (!f) return 0;
+
+    if (fstat(fileno(f), &st) == -1 || !fgets(hdr, sizeof(hdr), f)) {
+	fclose(f);
+	return 0;
+    }
+
+    p = strchr(hdr, '\n');
+    if (p) *p = '\0';
+    p = strchr(hdr, '\t');
+    if (!p || strncmp(hdr, INDEX_MAGIC " ", strlen(INDEX_MAGIC) + 1) ||
+	strcmp(p + 1, route_dir()))
+    {
+	fclose(f);
+	return 0;
+    }
+    valid = (strtol(hdr + strlen(INDEX_MAGIC), NULL, 10) == (long)mtime);
+
+    free(index_buf);
+    index_len = 0;
+    index_size = st.st_size + 1;
+    index_buf = malloc(index_size);
+    if (index_buf) {
+	index_len = fread(index_buf, 1, st.st_size, f);
+	index_buf[index_len] = '\0';
+    } else {
+	index_size = 0;
+	nroutes = 0;
+    }
+    fclose(f);
+
+    if (!index_buf || index_parse() == -1)
+	return 0;
+    return valid;
+}
+
+/* scan the directory, reusing whatever is still valid in the old index */
+static int index_rebuild(time_t mtime)
+{
+    struct route_info *old = routes, *o, r;
+    char start[INDEX_DESC], end[INDEX_DESC];
+    char path[PATH_MAX], line[PATH_MAX + 4 * INDEX_DESC];
+    char *buf = NULL;
+    int len = 0, size = 0, nold = nroutes;
+    struct dirent *entry;
+    struct stat s;
+    DIR *dir;
+
+    dir = opendir(route_dir());
+    if (!dir) return 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+	route_path(path, entry->d_name);
+	if (stat(path, &s) != 0 || !S_ISREG(s.st_mode))
+	    continue;
+
+	o = index_lookup(old, nold, entry->d_name);
+	if (o && o->size == s.st_size && o->mtime == s.st_mtime) {
+	    r = *o;
+	} else {
+	    r.start_desc = start;
+	    r.end_desc = end;
+	    if (index_scan(path, &r) == -1)
+		continue;
+	}
+	r.size = s.st_size;
+	r.mtime = s.st_mtime;
+
+	snprintf(line, sizeof(line),
+		 "%ld %ld %.10f %.10f %d %d %d %d %d %d %d %d\t%s\t%s\t%s\n",
+		 r.size, (long)r.mtime, r.center.lat, r.center.lon,
+		 r.min.x, r.min.y, r.max.x, r.max.y,
+		 r.start.x, r.start.y, r.end.x, r.end.y,
+		 entry->d_name, r.start_desc, r.end_desc);
+	if (index_append(&buf, &len, &size, line) == -1)
+	    break;
+    }
+    closedir(dir);
+
+    /* the old routes array points into the old buffer */
+    free(index_buf);
+    index_buf = buf;
+    index_len = len;
+    index_size = size;
+    index_mtime = mtime;
+
+    if (!index_buf) {
+	nroutes = 0;
+	return 0;
+    }
+
+    /* parsing splits the buffer into strings, so write it out first */
+    index_write();
+    return index_parse() == 0;
+}
+
+/* a route file didn't match its index entry, look again next time */
+void routes_stale(void)
+{
+    index_stale = 1;
+}
+
+static unsigned int dist_to(double dx, double dy, const struct xy *pt)
+{
+    dx -= pt->x;
+    dy -= pt->y;
+    return sqrt(dx * dx + dy * dy);
+}
+
+/* How far is the route from here, without loading it. Our offset from the
+ * route's center is a good enough approximation of its projected coordinates
+ * at these distances. Being close to the start point matters most, so the
+ * return trip of a commute ranks below the way out when we're at home, but
+ * being on the route at all (inside its bounding box) counts as well. */
+static unsigned int route_distance(const struct route_info *r)
+{
+    double dx, dy;
+    struct xy box;
+
+    dx = (gps_coord.lon - r->center.lon) * cos(r->center.lat) * EARTH_RADIUS;
+    dy = (gps_coord.lat - r->center.lat) * EARTH_RADIUS;
+
+    box.x = dx < r->min.x ? r->min.x : dx > r->max.x ? r->max.x : dx;
+    box.y = dy < r->min.y ? r->min.y : dy > r->max.y ? r->max.y : dy;
+
+    return dist_to(dx, dy, &box) + dist_to(dx, dy, &r->start) / 4;
+}
+
+static void routes_rank(void)
+{
+    unsigned int d;
+    int i, j;
+
+    nnearest = 0;
+    if (!(gps_state.fix & 0x1))
+	return;
+
+    for (i = 0; i < nroutes; i++) {
+	d = route_distance(&routes[i]);
+	if (d > NEAREST_MAX)
+	    continue;
+
+	/* insert into the short sorted list */
+	for (j = nnearest; j > 0 && nearest_dist[j-1] > d; j--) {
+	    if (j == NEAREST) continue;
+	    nearest[j] = nearest[j-1];
+	    nearest_dist[j] = nearest_dist[j-1];
+	}
+	if (j == NEAREST) continue;
+	nearest[j] = i;
+	nearest_dist[j] = d;
+	if (nnearest < NEAREST) nnearest++;
+    }
+}
+
+int routes_init(void)
+{
+    struct stat s;
+
+    if (stat(route_dir(), &s) != 0)
+	return 0;
+
+    /* the index is still up to date */
+    if (index_buf && !index_stale && s.st_mtime == index_mtime)
+	goto rank;
+
+    if (index_stale || !index_read(s.st_mtime)) {
+	if (!index_rebuild(s.st_mtime))
+	    return 0;
+    }
+    index_mtime = s.st_mtime;
+    index_stale = 0;
+
+rank:
+    routes_rank();
+    if (nnearest || selected_route >= nnearest + nroutes)
+	selected_route = 0;
+    return 1;
+}
+
+struct route_info *routes_selected(void)
+{
+    if (!routes || selected_route < 0 || selected_route >= nnearest + nroutes)
+	return NULL;
+    return route_entry(selected_route);
+}
+
+void routes_list(void)
+{
+    char buf[NAME_MAX + 20], dist[20];
+
+    if (!routes || !nroutes) {
+	draw_msg("No routes found");
+	return;
+    }
+
+    if (selected_route < nnearest) {
+	formatdist(dist, nearest_dist[selected_route]);
+	snprintf(buf, sizeof(buf), "%s (%s)", route_entry(selected_route)->name,
+		 dist);
+	draw_msg(buf);
+    } else
+	draw_msg(route_entry(selected_route)->name);
+}
+
+void route_select(int updown)
+{
+    if (updown) selected_route++;
+    else        selected_route--;
+
+    if (selected_route >= nnearest + nroutes) selected_route = 0;
+    else if (selected_route < 0) selected_route = nnearest + nroutes - 1;
+}
+
+/* jump to the first route starting with the next or previous letter */
+void route_jump(int updown)
+{
+    int i, c;
+
+    if (!nroutes) return;
+
+    c = tolower(route_entry(selected_route)->name[0]);
+    for (i = 1; i < nnearest + nroutes; i++) {
+	route_select(updown);
+	if (selected_route < nnearest ||
+	    tolower(route_entry(selected_route)->name[0]) != c)
+	    break;
+    }
+
+    /* going back we want the first of that letter, not the last */
+    if (!updown && selected_route >= nnearest) {
+	c = tolower(route_entry(selected_route)->name[0]);
+	while (selected_route > nnearest &&
+	       tolower(route_entry(selected_route-1)->name[0]) == c)
+	    selected_route--;
+    }
+}
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Finds a new way to the end of the route over the road graph given with
+ * graph=<path>, made on the host by mkgraph.py. The graph is mapped into
+ * memory and used as is, only the pages the search touches are ever read.
+ *
+ * The nodes are the points where roads meet, sorted by the 1km cell they are
+ * in so that we can find the one closest to where we are. The edges leaving
+ * a node are stored together and carry the length, road class and name of
+ * the road and the points in between, as 16-bit deltas on the grid of the
+ * graph. Two way roads have an edge in either direction that share the same
+ * points.
+ *
+ * The search is A* on the expected travel time, with the straight line at
+ * highway speeds as the estimate. It runs a slice at a time from the main
+ * loop, with a fixed number of nodes it may visit and a limit on the time it
+ * may take. The result is turned into a route with a waypoint wherever the
+ * name of the road changes, and replaces the active route.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gpsapp.h"
+
+#define GRAPH_MAGIC "GRPH"
+#define GRAPH_VERSION 1
+#define GRAPH_HDR 64
+#define EDGE_SIZE 16
+#define EDGE_REVERSED 0x80000000
+#define EDGE_LENGTH 0xffffff
+#define SNAP_CELLS 2		/* how many cells around us we look for a node */
+#define ROUTER_MAXVISIT 32768	/* nodes the search may visit */
+#define ROUTER_HASH (2 * ROUTER_MAXVISIT)
+#define ROUTER_SLICE 20000	/* microseconds of searching per iteration */
+#define ROUTER_MAXTIME 30	/* seconds before we give up */
+
+/* header, all values little endian
+ *  0 magic, 4 version (16 bits), 6 log2 of the cell size in meters (16 bits)
+ *  8 latitude, 12 longitude of the center of the grid (microdegrees)
+ * 16 number of nodes, 20 number of edges
+ * 24 column, 28 row of the first cell, 32 columns, 34 rows (16 bits)
+ * 36 offsets of the cells, nodes, first edges, edges, shapes and names
+ * 60 size of the file
+ *
+ * cells:  index of the first node of every cell, row by row, and one more
+ * nodes:  x, y on the grid of the graph
+ * first:  index of the first edge leaving every node, and one more
+ * edges:  target node, offset of the shape, offset of the name, and the
+ *	   length in meters (24 bits), road class (7 bits) and a flag that
+ *	   says the shape runs from the target back to us
+ * shapes: number of points (16 bits), the points in between the two nodes
+ *	   as pairs of 16-bit deltas, the first one from the node it starts at
+ * names:  nul terminated, offset 0 is the empty string */
+
+/* expected milliseconds per meter for every road class, 100, 60 and 40 km/h */
+static const int class_cost[] = { 36, 60, 90 };
+#define MIN_COST 36
+
+struct visit {
+    unsigned int node;
+    int g;		/* milliseconds from where we start */
+    int f;		/* g plus the estimate for the rest of the way */
+    int parent;		/* visit we came from, -1 at the start */
+    unsigned int edge;	/* edge we came over */
+    int heap;		/* position in the open set, -1 when done */
+};
+
+enum { ROUTE_SEARCH, ROUTE_BUILD };
+
+char *graphfile = NULL;
+
+static unsigned char *graph;
+static size_t graph_size;
+static struct coord origin;	/* center of the grid of the graph */
+static unsigned int nnodes, nedges;
+static int cell_shift, cx0, cy0, ncols, nrows;
+static unsigned char *cells, *nodes, *first, *edges, *shapes, *names;
+static unsigned int shapes_size, names_size;
+
+/* the search in progress */
+static struct router {
+    int phase;
+    struct timeval started;
+    struct coord center;	/* of the map grid when we started */
+    unsigned int goal;
+    int gx, gy;			/* where the goal node is */
+    struct xy from, to;		/* where we are and want to be, graph grid */
+    char *dest;			/* name of the end of the route */
+    char *msg;			/* why we gave up */
+
+    struct visit *visits;
+    int nvisits;
+    int *hash;
+    int *heap;
+    int nheap;
+
+    /* the new route, the points are converted a slice at a time */
+    struct xy *pts;
+    int npts, nconv;
+    struct wp *wps;
+    int nwps;
+} *search;
+
+static unsigned int get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* the sections must be within the file and in the right order */
+static int check_sections(void)
+{
+    unsigned int off[7];
+    int i;
+
+    for (i = 0; i < 7; i++) {
+	off[i] = get32(&graph[36 + 4 * i]);
+	if (off[i] < GRAPH_HDR || off[i] > graph_size || (off[i] & 3) ||
+	    (i && off[i] < off[i-1]))
+	    return -1;
+    }
+
+    if (off[1] - off[0] < ((unsigned int)ncols * nrows + 1) * 4 ||
+	off[2] - off[1] < nnodes * 8 ||
+	off[3] - off[2] < (nnodes + 1) * 4 ||
+	off[4] - off[3] < nedges * EDGE_SIZE)
+	return -1;
+
+    cells = graph + off[0];
+    nodes = graph + off[1];
+    first = graph + off[2];
+    edges = graph + off[3];
+    shapes = graph + off[4];
+    names = graph + off[5];
+    shapes_size = off[5] - off[4];
+    names_size = off[6] - off[5];
+
+    /* the last name has to be terminated */
+    if (!names_size || names[names_size-1] != '\0' ||
+	get32(&cells[ncols * nrows * 4]) != nnodes ||
+	get32(&first[nnodes * 4]) != nedges)
+	return -1;
+    return 0;
+}
+
+void router_open(void)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (!graphfile || graph)
+	return;
+
+    fd = open(graphfile, O_RDONLY);
+    if (fd == -1)
+	return;
+
+    if (fstat(fd, &st) == -1 || st.st_size < GRAPH_HDR) {
+	close(fd);
+	return;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return;
+
+    graph = p;
+    graph_size = st.st_size;
+
+    if (memcmp(graph, GRAPH_MAGIC, 4) != 0 ||
+	get16(&graph[4]) != GRAPH_VERSION)
+	goto bad;
+
+    cell_shift = get16(&graph[6]);
+    origin.lat = degtorad((int)get32(&graph[8]) / 1000000.0);
+    origin.lon = degtorad((int)get32(&graph[12]) / 1000000.0);
+    nnodes = get32(&graph[16]);
+    nedges = get32(&graph[20]);
+    cx0 = (int)get32(&graph[24]);
+    cy0 = (int)get32(&graph[28]);
+    ncols = get16(&graph[32]);
+    nrows = get16(&graph[34]);
+
+    if (cell_shift > 24 || !nnodes || nnodes > graph_size / 8 ||
+	nedges > graph_size / EDGE_SIZE || get32(&graph[60]) != graph_size ||
+	check_sections() == -1)
+	goto bad;
+    return;
+
+bad:
+    router_close();
+}
+
+static void router_free(void)
+{
+    if (!search) return;
+
+    if (search->visits) free(search->visits);
+    if (search->hash) free(search->hash);
+    if (search->heap) free(search->heap);
+    if (search->pts) free(search->pts);
+    if (search->wps) free(search->wps);
+    if (search->dest) free(search->dest);
+    free(search);
+    search = NULL;
+}
+
+void router_close(void)
+{
+    router_free();
+
+    if (graph)
+	munmap(graph, graph_size);
+    graph = NULL;
+}
+
+int router_busy(void)
+{
+    return search != NULL;
+}
+
+static void node_xy(unsigned int node, int *x, int *y)
+{
+    *x = (int)get32(&nodes[node * 8]);
+    *y = (int)get32(&nodes[node * 8 + 4]);
+}
+
+/* closest node to a point on the grid of the graph, -1 if there is none */
+static int snap(const struct xy *p)
+{
+    long long d, best = -1;
+    int cx, cy, i, x, y, n = -1;
+    unsigned int node, last;
+
+    for (cy = (p->y >> cell_shift) - SNAP_CELLS;
+	 cy <= (p->y >> cell_shift) + SNAP_CELLS; cy++) {
+	if (cy < cy0 || cy >= cy0 + nrows) continue;
+
+	for (cx = (p->x >> cell_shift) - SNAP_CELLS;
+	     cx <= (p->x >> cell_shift) + SNAP_CELLS; cx++) {
+	    if (cx < cx0 || cx >= cx0 + ncols) continue;
+
+	    i = (cy - cy0) * ncols + cx - cx0;
+	    last = get32(&cells[(i + 1) * 4]);
+	    for (node = get32(&cells[i * 4]); node < last && node < nnodes;
+		 node++) {
+		node_xy(node, &x, &y);
+		d = (long long)(x - p->x) * (x - p->x) +
+		    (long long)(y - p->y) * (y - p->y);
+		if (best == -1 || d < best) {
+		    best = d;
+		    n = node;
+		}
+	    }
+	}
+    }
+    return n;
+}
+
+/* a map grid position on the grid of the graph */
+static void to_graph(const struct coord *center, const struct xy *p,
+		     struct xy *out)
+{
+    double lat, lon, x, y;
+
+    inverseTM(center, p->x, p->y, &lat, &lon);
+    projectTM(&origin, lat, lon, &x, &y);
+    out->x = floor(x + 0.5);
+    out->y = floor(y + 0.5);
+}
+
+static int estimate(unsigned int node)
+{
+    int x, y;
+
+    node_xy(node, &x, &y);
+    return hypot(x - search->gx, y - search->gy) * MIN_COST;
+}
+
+/* the open set is a binary heap on f */
+static void heap_set(int pos, int v)
+{
+    search->heap[pos] = v;
+    search->visits[v].heap = pos;
+}
+
+static void heap_up(int pos)
+{
+    int v = search->heap[pos], parent;
+
+    while (pos) {
+	parent = (pos - 1) / 2;
+	if (search->visits[search->heap[parent]].f <= search->visits[v].f)
+	    break;
+	heap_set(pos, search->heap[parent]);
+	pos = parent;
+    }
+    heap_set(pos, v);
+}
+
+static int heap_pop(void)
+{
+    int top = search->heap[0], v, pos = 0, child;
+
+    search->visits[top].heap = -1;
+    if (--search->nheap == 0)
+	return top;
+
+    v = search->heap[search->nheap];
+    while ((child = 2 * pos + 1) < search->nheap) {
+	if (child + 1 < search->nheap &&
+	    search->visits[search->heap[child+1]].f <
+	    search->visits[search->heap[child]].f)
+	    child++;
+	if (search->visits[v].f <= search->visits[search->heap[child]].f)
+	    break;
+	heap_set(pos, search->heap[child]);
+	pos = child;
+    }
+    heap_set(pos, v);
+    return top;
+}
+
+/* the visit for a node, a new one when create is set. Returns -1 when the
+ * node wasn't visited yet, or when we ran out of room */
+static int visit(unsigned int node, int create)
+{
+    int h = (node * 2654435761U) % ROUTER_HASH;
+    struct visit *v;
+
+    while (search->hash[h] != -1) {
+	if (search->visits[search->hash[h]].node == node)
+	    return search->hash[h];
+	if (++h == ROUTER_HASH) h = 0;
+    }
+
+    if (!create || search->nvisits == ROUTER_MAXVISIT)
+	return -1;
+
+    search->hash[h] = search->nvisits;
+    v = &search->visits[search->nvisits];
+    v->node = node;
+    v->heap = -1;
+    return search->nvisits++;
+}
+
+static const unsigned char *edge(unsigned int e)
+{
+    return &edges[e * EDGE_SIZE];
+}
+
+static const char *edge_name(unsigned int e)
+{
+    unsigned int off = get32(&edge(e)[8]);
+    return off < names_size ? (const char *)&names[off] : "";
+}
+
+/* number of points in between the nodes of an edge */
+static int edge_npts(unsigned int e)
+{
+    unsigned int off = get32(&edge(e)[4]);
+
+    if (off + 2 > shapes_size) return 0;
+    if (off + 2 + get16(&shapes[off]) * 4 > shapes_size) return 0;
+    return get16(&shapes[off]);
+}
+
+static int build_route(int goal);
+
+/* look at one more node, returns 1 while there is more to do and -1 when
+ * there is no way */
+static int search_step(void)
+{
+    struct visit *v, *w;
+    unsigned int e, last, info, target;
+    int cur, next, g, cls;
+
+    if (!search->nheap) {
+	search->msg = "No route found";
+	return -1;
+    }
+
+    cur = heap_pop();
+    v = &search->visits[cur];
+    if (v->node == search->goal)
+	return build_route(cur);
+
+    last = get32(&first[(v->node + 1) * 4]);
+    for (e = get32(&first[v->node * 4]); e < last && e < nedges; e++) {
+	target = get32(&edge(e)[0]);
+	info = get32(&edge(e)[12]);
+	if (target >= nnodes)
+	    continue;
+
+	cls = (info >> 24) & 0x7f;
+	g = v->g + (info & EDGE_LENGTH) * class_cost[cls < 3 ? cls : 2];
+
+	next = visit(target, 0);
+	if (next == -1) {
+	    next = visit(target, 1);
+	    if (next == -1) {
+		/* visited as many nodes as we may */
+		search->msg = "No route found";
+		return -1;
+	    }
+	    w = &search->visits[next];
+	    w->g = g;
+	    w->f = g + estimate(target);
+	    w->parent = cur;
+	    w->edge = e;
+	    heap_set(search->nheap++, next);
+	    heap_up(w->heap);
+	    continue;
+	}
+
+	/* found a quicker way to a node that is still open */
+	w = &search->visits[next];
+	if (w->heap == -1 || g >= w->g)
+	    continue;
+	w->f -= w->g - g;
+	w->g = g;
+	w->parent = cur;
+	w->edge = e;
+	heap_up(w->heap);
+    }
+    return 1;
+}
+
+static void add_point(int x, int y)
+{
+    struct xy *p = &search->pts[search->npts];
+
+    if (search->npts && p[-1].x == x && p[-1].y == y)
+	return;
+    p->x = x;
+    p->y = y;
+    search->npts++;
+}
+
+static void add_wp(const char *name)
+{
+    struct wp *wp;
+
+    if (!*name) name = "(unnamed road)";
+
+    /* more than one at the same point, the last one wins */
+    wp = &search->wps[search->nwps];
+    if (search->nwps && wp[-1].idx == search->npts - 1)
+	wp--;
+    else
+	search->nwps++;
+
+    memset(wp, 0, sizeof(*wp));
+    wp->idx = search->npts - 1;
+    wp->short_desc = (char *)name;
+}
+
+
+/* the points in between the nodes of an edge, in the direction we drive it */
+static void add_shape(unsigned int e, unsigned int from)
+{
+    const unsigned char *p = &shapes[get32(&edge(e)[4]) + 2];
+    struct xy *pts = &search->pts[search->npts], tmp;
+    int i, n = edge_npts(e), x, y;
+
+    /* reversed edges are stored from the other end */
+    if (get32(&edge(e)[12]) & EDGE_REVERSED)
+	from = get32(&edge(e)[0]);
+
+    node_xy(from, &x, &y);
+    for (i = 0; i < n; i++) {
+	x += (short)get16(&p[i * 4]);
+	y += (short)get16(&p[i * 4 + 2]);
+	pts[i].x = x;
+	pts[i].y = y;
+    }
+
+    if (get32(&edge(e)[12]) & EDGE_REVERSED)
+	for (i = 0; i < n / 2; i++) {
+	    tmp = pts[i];
+	    pts[i] = pts[n-1-i];
+	    pts[n-1-i] = tmp;
+	}
+    search->npts += n;
+}
+
+/* we got there, follow the edges back to where we started and lay out the
+ * points and waypoints of the new route, still on the grid of the graph */
+static int build_route(int goal)
+{
+    struct visit *v;
+    const char *name, *prev = NULL;
+    int i, n = 3, nsteps = 0, x, y;
+    unsigned int node;
+
+    /* the heap isn't needed anymore, it holds the way back instead */
+    for (i = goal; search->visits[i].parent != -1; i = search->visits[i].parent) {
+	n += edge_npts(search->visits[i].edge) + 1;
+	search->heap[nsteps++] = i;
+    }
+
+    search->pts = malloc(n * sizeof(struct xy));
+    search->wps = malloc((nsteps + 2) * sizeof(struct wp));
+    if (!search->pts || !search->wps) {
+	search->msg = "Failed allocation for route";
+	return -1;
+    }
+
+    add_point(search->from.x, search->from.y);
+    while (nsteps--) {
+	v = &search->visits[search->heap[nsteps]];
+	node = search->visits[v->parent].node;
+	name = edge_name(v->edge);
+
+	/* the first waypoint is where we are now */
+	if (!prev) add_wp(name);
+
+	node_xy(node, &x, &y);
+	add_point(x, y);
+	if (prev && strcmp(name, prev) != 0)
+	    add_wp(name);
+	add_shape(v->edge, node);
+	prev = name;
+    }
+
+    node_xy(search->goal, &x, &y);
+    add_point(x, y);
+    add_point(search->to.x, search->to.y);
+    if (search->dest)	add_wp(search->dest);
+    else if (prev)	add_wp(prev);
+    else		add_wp("");
+
+    search->phase = ROUTE_BUILD;
+    return 1;
+}
+
+/* one step of the search, or of converting the points to the map grid */
+static int router_step(void)
+{
+    double lat, lon, x, y;
+    struct xy *p;
+
+    /* the user picked another route in the meantime */
+    if (route_loading() != -1 ||
+	search->center.lat != coord_center.lat ||
+	search->center.lon != coord_center.lon)
+	return -1;
+
+    if (search->phase == ROUTE_SEARCH)
+	return search_step();
+
+    if (search->nconv == search->npts)
+	return 0;
+
+    p = &search->pts[search->nconv++];
+    inverseTM(&origin, p->x, p->y, &lat, &lon);
+    projectTM(&search->center, lat, lon, &x, &y);
+    p->x = floor(x + 0.5);
+    p->y = floor(y + 0.5);
+    return 1;
+}
+
+/* search some more, returns 1 while there is more to do */
+int router_poll(void)
+{
+    struct timeval start, now, diff;
+    char *msg;
+    int n = 0, rc;
+
+    if (!search) return 0;
+
+    gettimeofday(&start, NULL);
+    while ((rc = router_step()) == 1) {
+	if (++n % 64) continue;
+
+	gettimeofday(&now, NULL);
+	timesub(&diff, &now, &start);
+	if (diff.tv_sec || diff.tv_usec >= ROUTER_SLICE)
+	    break;
+    }
+
+    if (rc == 1) {
+	gettimeofday(&now, NULL);
+	timesub(&diff, &now, &search->started);
+	if (diff.tv_sec < ROUTER_MAXTIME)
+	    return 1;
+	search->msg = "No route found";
+	rc = -1;
+    }
+
+    if (rc == 0 && route_replace(search->pts, search->npts,
+				 search->wps, search->nwps) == -1) {
+	search->msg = "Failed allocation for route";
+	rc = -1;
+    }
+
+    msg = rc == -1 ? search->msg : NULL;
+    router_free();
+    if (msg) err(msg);
+    do_refresh = 1;
+    return 0;
+}
+
+/* start looking for a way from where we are to the end of the route */
+void router_start(void)
+{
+    const char *name;
+    struct xy dest;
+    double x, y;
+    int start, goal, v;
+
+    if (!graph) {
+	err("No road graph");
+	return;
+    }
+
+    if (route_loading() != -1) {
+	err("Route still loading");
+	return;
+    }
+
+    if (!route_dest(&dest, &name)) {
+	err("No route loaded");
+	return;
+    }
+
+    if (gps_coord.lat == 0.0 && gps_coord.lon == 0.0) {
+	err("No GPS fix");
+	return;
+    }
+
+    router_free();
+    search = calloc(1, sizeof(*search));
+    if (!search) {
+	err("Failed allocation for route");
+	return;
+    }
+    search->visits = malloc(ROUTER_MAXVISIT * sizeof(struct visit));
+    search->hash = malloc(ROUTER_HASH * sizeof(int));
+    search->heap = malloc(ROUTER_MAXVISIT * sizeof(int));
+    if (name) search->dest = strdup(name);
+    if (!search->visits || !search->hash || !search->heap ||
+	(name && !search->dest)) {
+	router_free();
+	err("Failed allocation for route");
+	return;
+    }
+    memset(search->hash, 0xff, ROUTER_HASH * sizeof(int));
+
+    search->center = coord_center;
+    projectTM(&origin, gps_coord.lat, gps_coord.lon, &x, &y);
+    search->from.x = floor(x + 0.5);
+    search->from.y = floor(y + 0.5);
+    to_graph(&coord_center, &dest, &search->to);
+
+    start = snap(&search->from);
+    goal = snap(&search->to);
+    if (start == -1 || goal == -1) {
+	router_free();
+	err("Not on the road graph");
+	return;
+    }
+
+    search->goal = goal;
+    node_xy(goal, &search->gx, &search->gy);
+
+    v = visit(start, 1);
+    search->visits[v].g = 0;
+    search->visits[v].f = estimate(start);
+    search->visits[v].parent = -1;
+    heap_set(search->nheap++, v);
+
+    search->phase = ROUTE_SEARCH;
+    gettimeofday(&search->started, NULL);
+    do_refresh = 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <sched.h>
+
+/* Single writer sequence lock. The writer bumps the sequence number to an odd
+ * value before, and back to an even value after modifying the protected data.
+ * Readers copy the data and retry when the sequence changed underneath them,
+ * so they never block the writer.
+ *
+ * The empeg is a uniprocessor StrongARM, and the host builds run on x86 which
+ * doesn't reorder loads with loads or stores with stores, so a compiler
+ * barrier is all we need to keep the accesses in order. */
+#define barrier() __asm__ __volatile__("" : : : "memory")
+
+typedef struct {
+    volatile unsigned int seq;
+} seqlock_t;
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+    sl->seq++;
+    barrier();
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+    barrier();
+    sl->seq++;
+}
+
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+    unsigned int seq;
+
+    /* on a uniprocessor the writer can't make progress while we spin */
+    while ((seq = sl->seq) & 1)
+	sched_yield();
+
+    barrier();
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t *sl, unsigned int seq)
+{
+    barrier();
+    return sl->seq != seq;
+}
+
+#endif
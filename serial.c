@@ -13,47 +13,121 @@
 #include <termios.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 #include "gpsapp.h"
+#include "seqlock.h"
+#include "metrics.h"
 
 /* If the protocol has a polling function, we call it once every 5 seconds */
 #define POLL_INTERVAL 5
 #define UPDATE_INTERVAL 1
+#define MIN_TRACK_SPEED 2000 /* meters per hour */
 
 #define SERIALDEV "/dev/ttyS1"
 #define GPSD_PORT 2947
 
+/* how long we wait for a connection to gpsd, and the maximum delay between
+ * reconnection attempts, in seconds */
+#define GPSD_TIMEOUT 2
+#define GPSD_MAX_BACKOFF 64
+
+/* autodetection listens this long (ms) to every baudrate/parity setting, and
+ * locks on as soon as a decoder recognizes SNIFF_LOCK packets */
+#define SNIFF_MSEC 300
+#define SNIFF_SLOW_MSEC 1200
+#define SNIFF_SIZE 1024
+#define SNIFF_LOCK 2
+
 int serialfd = -1;
+static int gpsdfd = -1;
 char *serport = NULL;
+int serbaud = 0; /* overrides the protocol's default baudrate when set */
 
 /* this is a buffer that can be shared by all protocols because only one will
  * be active at a time anyways */
 unsigned char packet[MAX_PACKET_SIZE];
 int packet_idx;
 
-/* this variable will be updated by the decoding protocol */
+/* this variable is only touched by the decoding protocol in the receiver
+ * thread, complete fixes are published as snapshots through fix_lock */
+static struct gps_state rx_state;
+
+/* latest snapshot published by the receiver thread */
+static seqlock_t	fix_lock;
+static struct gps_state fix;
+static volatile unsigned int fix_seen; /* seq of the last one the UI read */
+
+static pthread_t    rx_thread;
+static volatile int rx_running;
+static volatile int rx_activity;
+static char * volatile rx_error; /* reported by the UI thread */
+static int rx_failed;		 /* rx_error was already set once */
+
+/* this variable is the copy of the latest snapshot used by the UI */
 struct gps_state gps_state;
 
 /* we update these whenever the location is updated */
 struct coord gps_coord;
 unsigned int gps_speed;
-int	     gps_avgvmg;
 int	     gps_bearing;
 
 struct gps_protocol *gps_protocols;       /* list of all protocols. */
 static struct gps_protocol *protocol; /* currently selected protocol */
+static struct gps_protocol *nmea;     /* relayed without translation */
+
+static int autodetect;	      /* protocol=auto was selected */
+static int rx_detect;	      /* receiver thread should detect the protocol */
+static int rx_baud;	      /* how we talk to the receiver, configured or */
+static char rx_parity;	      /* detected, when we reopen the serial port */
+
+/* autodetection progress, only used by the receiver thread */
+static struct {
+    struct { int baud; char parity; } try[32];
+    int ntry, next, msec;
+    struct gps_protocol *best;
+    int score, baud;
+    char parity;
+} sniff;
+
+/* gpsd connection state, only used by the receiver thread */
+static enum {
+    GPSD_DISABLED = 0,
+    GPSD_IDLE,
+    GPSD_CONNECTING,
+    GPSD_CONNECTED,
+} gpsd_state;
+static time_t gpsd_retry;   /* next connection attempt, or connect timeout */
+static int    gpsd_backoff;
+
+static void *serial_thread(void *arg);
+static int serial_autodetect(void);
+
+static struct gps_protocol *find_protocol(char *proto)
+{
+    struct gps_protocol *p;
+
+    for (p = gps_protocols; p; p = p->next)
+	if (strcasecmp(proto, p->name) == 0)
+	    break;
+    return p;
+}
 
 void serial_protocol(char *proto)
 {
-    for (protocol = gps_protocols; protocol; protocol = protocol->next)
-	if (strcasecmp(proto, protocol->name) == 0)
-	    break;
+    autodetect = (strcasecmp(proto, "AUTO") == 0);
+    protocol = find_protocol(proto);
 }
 
-static int gpsd_open(void)
+/* make sure that at the loopback network device is up, otherwise we might get
+ * stuck trying to connect to gpsd. This code is taken from dbrashear's
+ * mini_ifconfig */
+static int gpsd_ifup(void)
 {
     struct ifreq ifr;
     struct sockaddr_in sin;
-    int fd, ret, flag = 1;
+    int fd, ret = -1;
     
     fd = socket(PF_INET, SOCK_STREAM, 0);
     if (fd == -1)
@@ -63,116 +137,180 @@ static int gpsd_open(void)
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-    /* make sure that at the loopback network device is up.
-     * This code is taken from dbrashear's mini_ifconfig */
     strcpy(ifr.ifr_name, "lo");
     memcpy(&ifr.ifr_addr, &sin, sizeof(struct sockaddr_in));
     /* set the inet address for 'lo' */
-    if (ioctl(fd, SIOCSIFADDR, &ifr) < 0) {
-	close(fd);
-	return -1;
-    }
+    if (ioctl(fd, SIOCSIFADDR, &ifr) < 0)
+	goto out;
 
     /* bring the interface up */
     ifr.ifr_flags = (IFF_UP | IFF_RUNNING);
-    if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
-	close(fd);
-	return -1;
-    }
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0)
+	goto out;
 
-    /* and now we can try to connect to the gpsd without having to worry about
-     * getting stuck in connect() */
-    sin.sin_port = htons(GPSD_PORT);
-    ret = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
-    if (ret == -1) {
-	close(fd);
-	return -1;
-    }
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
 
-    setsockopt(fd, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    //fcntl(fd, F_SETFL, O_NONBLOCK);
+static void serial_start(void);
+static void serial_stop(void);
 
-    /* Tell gpsd to output raw NMEA sentences */
-    write(fd, "R", 1);
+static void gpsd_up(void)
+{
+    /* Ask gpsd to push position (O) and satellite (Y) reports as soon as
+     * anything changes, which we decode straight into rx_state */
+    write(gpsdfd, "w+\n", 3);
 
-    /* drop back to NMEA, because that is what gpsd is actually spitting out */
-    serialfd = fd;
-    serial_protocol("NMEA");
+    gpsd_state = GPSD_CONNECTED;
+    gpsd_backoff = 1;
+    gpsd_protocol.init();
 
-    return 0;
+    /* gpsd needs the serial port */
+    serial_stop();
 }
 
-void serial_open(void)
+static void gpsd_down(void)
 {
-    int ret = -1, parity;
-    speed_t spd;
-    struct termios termios;
+    if (gpsdfd != -1) {
+	close(gpsdfd);
+	gpsdfd = -1;
+    }
 
-    if (serialfd != -1)
-	serial_close();
+    gpsd_state = GPSD_IDLE;
+    gpsd_retry = time(NULL) + gpsd_backoff;
+    if (gpsd_backoff < GPSD_MAX_BACKOFF)
+	gpsd_backoff <<= 1;
 
-    /* try to open a socket to the gpsd daemon */
-    ret = gpsd_open();
-    if (ret != -1) goto exit;
+    /* fall back on reading the receiver ourselves */
+    if (serialfd == -1)
+	serial_start();
+}
 
-    /* if that failed, try to open the serial port direcly */
-    if (!protocol) {
-	err("Unknown protocol, using NMEA");
-	serial_protocol("NMEA");
+static void gpsd_connect(void)
+{
+    struct sockaddr_in sin;
+    int flag = 1;
+
+    gpsdfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (gpsdfd == -1) {
+	gpsd_down();
+	return;
     }
 
-    if (protocol->baud == 0)
-	goto tracklog;
+    fcntl(gpsdfd, F_SETFL, O_RDWR | O_NONBLOCK);
+    setsockopt(gpsdfd, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
 
-    serialfd = open(serport?serport:SERIALDEV, O_NOCTTY | O_RDWR | O_NONBLOCK);
-    if (serialfd == -1) goto exit;
+    memset(&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(GPSD_PORT);
 
-    ret = tcgetattr(serialfd, &termios);
-    if (ret == -1) goto exit;
+    if (connect(gpsdfd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+	gpsd_up();
+    else if (errno == EINPROGRESS) {
+	gpsd_state = GPSD_CONNECTING;
+	gpsd_retry = time(NULL) + GPSD_TIMEOUT;
+    } else
+	gpsd_down();
+}
 
-    switch(protocol->baud) {
-    case 9600: spd = B9600; break;
+/* the non-blocking connect finished, see whether it succeeded */
+static void gpsd_connected(void)
+{
+    socklen_t len = sizeof(int);
+    int error = 0;
+
+    if (getsockopt(gpsdfd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error)
+	gpsd_down();
+    else
+	gpsd_up();
+}
+
+static speed_t serial_speed(int baud)
+{
+    switch(baud) {
+    case 1200:	 return B1200;
+    case 2400:	 return B2400;
+    case 9600:	 return B9600;
+    case 19200:	 return B19200;
+    case 38400:	 return B38400;
+#ifdef B57600
+    case 57600:	 return B57600;
+#endif
+#ifdef B115200
+    case 115200: return B115200;
+#endif
     case 4800:
-    default:   spd = B4800; break;
+    default:	 return B4800;
     }
-    switch(protocol->parity) {
-    case 'O': parity = PARENB | PARODD; break;
-    case 'E': parity = PARENB; break;
+}
+
+static int serial_setup(int baud, char parity)
+{
+    struct termios termios;
+    speed_t spd = serial_speed(baud);
+    int ret, par;
+
+    ret = tcgetattr(serialfd, &termios);
+    if (ret == -1) return -1;
+
+    switch(parity) {
+    case 'O': par = PARENB | PARODD; break;
+    case 'E': par = PARENB; break;
     case 'N': 
-    default:  parity = 0; break;
+    default:  par = 0; break;
     }
 
     termios.c_iflag = 0;
     termios.c_oflag = 0; // ONLRET;
-    termios.c_cflag = (CSIZE & CS8) | CREAD | CLOCAL | parity;
+    termios.c_cflag = (CSIZE & CS8) | CREAD | CLOCAL | par;
     termios.c_lflag = 0;
     cfsetispeed(&termios, spd);
     cfsetospeed(&termios, spd);
 
-    ret = tcsetattr(serialfd, TCSANOW, &termios);
+    return tcsetattr(serialfd, TCSANOW, &termios);
+}
+
+/* open the serial port, only called from the receiver thread */
+static void serial_start(void)
+{
+    int ret;
+
+    if (!autodetect && protocol->baud == 0)
+	goto tracklog;
+
+    serialfd = open(serport?serport:SERIALDEV, O_NOCTTY | O_RDWR | O_NONBLOCK);
+    if (serialfd == -1) goto exit;
+
+    /* with autodetection we pick the real settings later on */
+    if (rx_detect)
+	ret = serial_setup(serbaud ? serbaud : 4800, 'N');
+    else
+	ret = serial_setup(rx_baud, rx_parity);
     if (ret == -1) goto exit;
 
     fcntl(serialfd, F_SETFL, O_RDWR | O_NOCTTY);
 
-exit:
-    if (ret == -1) {
-	serial_close();
-	err("Failed to set up serial port");
+    /* the receiver thread's loop runs the autodetection */
+    if (rx_detect)
 	return;
-    }
 
 tracklog:
     if (protocol->init)
 	protocol->init();
+    return;
 
-    /* This a bit of a weird solution. While we're waiting for a fix we don't
-     * have gps time. But if the time is 0 all new satellites will be assigned
-     * to the the first available slot. So we either have to initialize all
-     * empty slots to -1, or... */
-    gps_state.time = 1;
+exit:
+    serial_stop();
+    if (!rx_failed) {
+	rx_failed = 1;
+	rx_error = "Failed to set up serial port";
+    }
 }
 
-void serial_close(void)
+static void serial_stop(void)
 {
     if (serialfd == -1)
 	return;
@@ -182,32 +320,389 @@ void serial_close(void)
     serialfd = -1;
 }
 
-static int serial_avail(void)
+void serial_open(void)
+{
+    if (rx_running)
+	serial_close();
+
+    if (!protocol && !autodetect) {
+	err("Unknown protocol, using NMEA");
+	serial_protocol("NMEA");
+    }
+    rx_detect = autodetect;
+    rx_failed = 0;
+    memset(&sniff, 0, sizeof(sniff));
+    if (!autodetect) {
+	rx_baud = serbaud ? serbaud : protocol->baud;
+	rx_parity = protocol->parity;
+    }
+
+    /* only try to talk to gpsd when we could bring up the loopback device */
+    gpsd_state = gpsd_ifup() == -1 ? GPSD_DISABLED : GPSD_IDLE;
+    gpsd_retry = 0;
+    gpsd_backoff = 1;
+
+    /* This a bit of a weird solution. While we're waiting for a fix we don't
+     * have gps time. But if the time is 0 all new satellites will be assigned
+     * to the the first available slot. So we either have to initialize all
+     * empty slots to -1, or... */
+    rx_state.time = 1;
+
+    /* the receiver thread picks gpsd or the serial port, from here on it owns
+     * the decoder and all writes to the receiver */
+    rx_running = 1;
+    if (pthread_create(&rx_thread, NULL, serial_thread, NULL)) {
+	rx_running = 0;
+	err("Failed to start receiver thread");
+    }
+}
+
+void serial_close(void)
+{
+    if (rx_running) {
+	rx_running = 0;
+	pthread_join(rx_thread, NULL);
+    }
+
+    if (gpsdfd != -1) {
+	close(gpsdfd);
+	gpsdfd = -1;
+    }
+    serial_stop();
+}
+
+/* called by the decoders whenever a packet is received, the activity
+ * indicator is drawn by the UI thread */
+void serial_activity(void)
+{
+    rx_activity++;
+}
+
+static void serial_publish(const struct timeval *stamp)
+{
+    rx_state.seq++;
+    rx_state.stamp = *stamp;
+
+    write_seqlock(&fix_lock);
+    /* the UI thread only looks once a second, don't let a GSV sentence
+     * hide that the RMC before it had a new speed */
+    if (fix.seq != fix_seen)
+	rx_state.updated |= fix.updated;
+    fix = rx_state;
+    write_sequnlock(&fix_lock);
+
+    rx_state.updated = 0;
+}
+
+/* collect whatever the receiver sends during msec milliseconds */
+static int serial_sniff(unsigned char *buf, int msec)
+{
+    struct timeval end, now, timeout;
+    fd_set rfds;
+    int n, len = 0;
+
+    tcflush(serialfd, TCIFLUSH);
+
+    gettimeofday(&end, NULL);
+    end.tv_sec += msec / 1000;
+    end.tv_usec += (msec % 1000) * 1000;
+    if (end.tv_usec >= 1000000) {
+	end.tv_sec++;
+	end.tv_usec -= 1000000;
+    }
+
+    while (rx_running && len < SNIFF_SIZE) {
+	gettimeofday(&now, NULL);
+	timesub(&timeout, &end, &now);
+	if (timeout.tv_sec < 0)
+	    break;
+
+	/* wake up now and then to see whether we should stop */
+	if (timeout.tv_sec || timeout.tv_usec > 50000) {
+	    timeout.tv_sec = 0;
+	    timeout.tv_usec = 50000;
+	}
+	FD_ZERO(&rfds);
+	FD_SET(serialfd, &rfds);
+
+	if (select(serialfd + 1, &rfds, NULL, NULL, &timeout) <= 0)
+	    continue;
+
+	n = read(serialfd, buf + len, SNIFF_SIZE - len);
+	if (n > 0) len += n;
+    }
+    return len;
+}
+
+/* Cycle through the baudrate/parity settings, first the defaults of the
+ * registered protocols, and then everything else we support. Every decoder
+ * scores the sniffed data by the number of correctly framed packets it finds.
+ * Only one setting is tried per call, so that the receiver thread can look
+ * after gpsd and the relay in between. Returns 0 when we locked onto a
+ * protocol. */
+static int serial_autodetect(void)
+{
+    static const int bauds[] = { 4800, 9600, 19200, 38400, 57600, 115200, 0 };
+    static const char parities[] = { 'N', 'O', 0 };
+    struct gps_protocol *p;
+    unsigned char buf[SNIFF_SIZE];
+    int i, j, k, len, score;
+
+    if (!sniff.ntry) {
+	for (p = gps_protocols; p; p = p->next) {
+	    if (!p->sniff || (serbaud && p->baud != serbaud)) continue;
+	    for (i = 0; i < sniff.ntry; i++)
+		if (sniff.try[i].baud == p->baud &&
+		    sniff.try[i].parity == p->parity)
+		    break;
+	    if (i < sniff.ntry) continue;
+	    sniff.try[sniff.ntry].baud = p->baud;
+	    sniff.try[sniff.ntry++].parity = p->parity;
+	}
+	for (i = 0; bauds[i]; i++) {
+	    if (serbaud && bauds[i] != serbaud) continue;
+	    for (j = 0; parities[j]; j++) {
+		for (k = 0; k < sniff.ntry; k++)
+		    if (sniff.try[k].baud == bauds[i] &&
+			sniff.try[k].parity == parities[j])
+			break;
+		if (k < sniff.ntry) continue;
+		sniff.try[sniff.ntry].baud = bauds[i];
+		sniff.try[sniff.ntry++].parity = parities[j];
+	    }
+	}
+	if (serbaud && !sniff.ntry) {
+	    sniff.try[sniff.ntry].baud = serbaud;
+	    sniff.try[sniff.ntry++].parity = 'N';
+	}
+	sniff.msec = SNIFF_MSEC;
+    }
+
+    i = sniff.next++;
+    if (serial_setup(sniff.try[i].baud, sniff.try[i].parity) != -1 &&
+	(len = serial_sniff(buf, sniff.msec)) != 0)
+    {
+	for (p = gps_protocols; p; p = p->next) {
+	    if (!p->sniff) continue;
+	    score = p->sniff(buf, len);
+	    if (score > sniff.score) {
+		sniff.best = p;
+		sniff.score = score;
+		sniff.baud = sniff.try[i].baud;
+		sniff.parity = sniff.try[i].parity;
+	    }
+	}
+    }
+
+    if (sniff.score >= SNIFF_LOCK) {
+#ifndef __arm__
+	fprintf(stderr, "detected %s at %d baud, parity %c (score %d)\n",
+		sniff.best->name, sniff.baud, sniff.parity, sniff.score);
+#endif
+	/* remembered for when we reopen the port after gpsd goes away */
+	rx_baud = sniff.baud;
+	rx_parity = sniff.parity;
+	serial_setup(rx_baud, rx_parity);
+	protocol = sniff.best;
+	return 0;
+    }
+
+    if (sniff.next == sniff.ntry) {
+	/* nothing we trust yet, a single packet may just be line noise that
+	 * happens to look right. Some receivers only send a burst of data
+	 * once a second, so listen a bit longer next time around */
+	sniff.next = 0;
+	sniff.best = NULL;
+	sniff.score = 0;
+	sniff.msec = SNIFF_SLOW_MSEC;
+    }
+    return -1;
+}
+
+static void serial_relay(void)
 {
-    int ret, avail = 0;
-    ret = ioctl(serialfd, FIONREAD, &avail, sizeof(int));
-    if (ret == -1) return 0;
-    return avail;
+    char buf[NMEA_MAX_SENTENCE];
+
+    relay_write(buf, nmea_rmc(buf, &rx_state));
+    relay_write(buf, nmea_gga(buf, &rx_state));
+}
+
+/* feed a chunk of received data to a decoder */
+static void serial_decode(struct gps_protocol *proto, unsigned char *buf, int n)
+{
+    struct timeval stamp;
+    int i;
+
+    gettimeofday(&stamp, NULL);
+
+    for (i = 0; i < n; i++) {
+	proto->update(buf[i], &rx_state);
+	if (!rx_state.updated)
+	    continue;
+
+	METRIC_COUNT(C_MESSAGES);
+
+	/* NMEA is relayed as is, for anything else we make up sentences */
+	if (proto != nmea && (rx_state.updated & GPS_STATE_COORD))
+	    serial_relay();
+
+	serial_publish(&stamp);
+    }
+
+    if (proto == nmea)
+	relay_write((char *)buf, n);
+
+    METRIC_END(M_DECODE, stamp);
+}
+
+/* The receiver thread reads and decodes everything the receiver sends us.
+ * It never waits on the display, so a slow refresh doesn't leave bytes piling
+ * up in the UART.
+ *
+ * When gpsd is running we get our data from gpsd, otherwise we read the
+ * serial port directly while we keep trying to reconnect to gpsd. */
+static void *serial_thread(void *arg)
+{
+    time_t poll_stamp = 0, now;
+    struct timeval timeout, t;
+    unsigned char buf[64];
+    fd_set rfds, wfds;
+    int n, maxfd, sfd;
+
+    nmea = find_protocol("NMEA");
+    if (relay_open() == -1)
+	rx_error = "Failed to start NMEA relay";
+
+    if (gpsd_state == GPSD_IDLE)
+	gpsd_connect();
+    else
+	serial_start();
+
+    while (rx_running) {
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	maxfd = sfd = serialfd;
+	if (sfd != -1 && !rx_detect)
+	    FD_SET(sfd, &rfds);
+	if (gpsd_state == GPSD_CONNECTING)
+	    FD_SET(gpsdfd, &wfds);
+	else if (gpsd_state == GPSD_CONNECTED)
+	    FD_SET(gpsdfd, &rfds);
+	if (gpsdfd > maxfd)
+	    maxfd = gpsdfd;
+	maxfd = relay_fdset(&rfds, &wfds, maxfd);
+
+	/* don't hold up the autodetection, it does its own waiting */
+	timeout.tv_sec = 0;
+	timeout.tv_usec = (sfd != -1 && rx_detect) ? 0 : 250000;
+
+	n = select(maxfd + 1, &rfds, &wfds, NULL, &timeout);
+	if (n < 0) continue;
+
+	relay_service(&rfds, &wfds);
+
+	if (gpsdfd != -1 && FD_ISSET(gpsdfd, &wfds))
+	    gpsd_connected();
+
+	else if (gpsdfd != -1 && FD_ISSET(gpsdfd, &rfds)) {
+	    METRIC_START(t);
+	    n = read(gpsdfd, buf, sizeof(buf));
+	    METRIC_END(M_READ, t);
+	    if (n > 0)
+		serial_decode(&gpsd_protocol, buf, n);
+	    else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+		gpsd_down(); /* gpsd went away */
+	}
+
+	/* make sure we didn't switch between gpsd and the serial port */
+	if (sfd != -1 && sfd == serialfd && FD_ISSET(sfd, &rfds)) {
+	    METRIC_START(t);
+	    n = read(serialfd, buf, sizeof(buf));
+	    METRIC_END(M_READ, t);
+	    if (n > 0)
+		serial_decode(protocol, buf, n);
+	    /* end of file or a hiccup, don't spin on it */
+	    else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+		select(0, NULL, NULL, NULL, &timeout);
+	}
+
+	now = time(NULL);
+	if ((gpsd_state == GPSD_IDLE || gpsd_state == GPSD_CONNECTING) &&
+	    gpsd_retry <= now)
+	{
+	    if (gpsd_state == GPSD_CONNECTING)
+		gpsd_down(); /* timed out */
+	    else
+		gpsd_connect();
+	}
+
+	/* one baudrate/parity setting at a time */
+	if (sfd != -1 && sfd == serialfd && rx_detect &&
+	    serial_autodetect() == 0)
+	{
+	    rx_detect = 0;
+	    if (protocol->init)
+		protocol->init();
+	}
+
+	if (serialfd != -1 && !rx_detect && protocol->poll &&
+	    poll_stamp + POLL_INTERVAL <= now)
+	{
+	    protocol->poll();
+	    poll_stamp = now;
+	}
+    }
+
+    relay_close();
+    return NULL;
+}
+
+/* copy the latest snapshot into gps_state, returns 1 if it was new */
+static int serial_fetch(void)
+{
+    static unsigned int last_seq;
+    struct gps_state snap;
+    unsigned int seq;
+    int updated;
+
+    do {
+	seq = read_seqbegin(&fix_lock);
+	snap = fix;
+    } while (read_seqretry(&fix_lock, seq));
+
+    if (snap.seq == last_seq)
+	return 0;
+    last_seq = fix_seen = snap.seq;
+
+    updated = gps_state.updated | snap.updated;
+    gps_state = snap;
+    gps_state.updated = updated;
+    return 1;
 }
 
 void serial_poll()
 {
-    static time_t poll_stamp, update_stamp;
+    static time_t update_stamp;
+    static int activity;
+    struct timeval start, t;
     time_t now;
-    char buf[16];
-    int n, i;
 
-    if (serialfd == -1)
+    if (!rx_running)
 	return;
 
-    while (serial_avail()) {
-	n = read(serialfd, buf, sizeof(buf));
-	if (n <= 0) break;
+    if (rx_error) {
+	char *msg = rx_error;
+	rx_error = NULL;
+	err(msg);
+    }
 
-	for (i = 0; i < n; i++)
-	    protocol->update(buf[i], &gps_state);
+    if (activity != rx_activity) {
+	activity = rx_activity;
+	draw_activity(0);
     }
 
+    serial_fetch();
+
     now = time(NULL);
     /* only updated once a second except when we have no fix, as the time isn't
      * updated in that case. And then only when we actually have received
@@ -215,38 +710,48 @@ void serial_poll()
     if ((!(gps_state.fix & 0x1) || (update_stamp + UPDATE_INTERVAL <= now)) &&
 	gps_state.updated)
     {
+	METRIC_START(start);
 	gps_coord.lat = gps_state.lat;
 	gps_coord.lon = gps_state.lon;
 
 	route_recenter();
 
+	METRIC_START(t);
 	toTM(&gps_coord);
+	METRIC_END(M_PROJECT, t);
 
 	gps_speed = sqrt(gps_state.spd_east * gps_state.spd_east +
 			 gps_state.spd_north * gps_state.spd_north +
 			 gps_state.spd_up * gps_state.spd_up) * 3600.0;
 
-	/* According to ellweber, bearing measurements are pretty flaky when
-	 * we're moving slower than 1-2 km/h, but the speed reported by my
-	 * receiver easily wanders up to 5 km/h when I'm standing still */
-	if (gps_speed >= 5000) {
+	if (gps_state.fix & 0x1)
+	    filter_fix(&gps_coord.xy, gps_state.updated & GPS_STATE_SPEED,
+		       gps_state.spd_east, gps_state.spd_north,
+		       &gps_state.stamp);
+
+	/* The filter damps the bearing at low speeds, but the speed reported
+	 * by a receiver easily wanders up to a few km/h when standing still,
+	 * so don't let that scribble over the track and average vmg */
+	gps_bearing = filter_heading();
+	if (filter_speed() >= MIN_TRACK_SPEED) {
 	    track_pos();
-	    gps_bearing = gps_state.bearing;
+	    trackfile_fix(&gps_state);
 	}
 
+	METRIC_START(t);
 	route_locate();
+	METRIC_END(M_LOCATE, t);
 
-	if (gps_speed >= 5000)
+	if (filter_speed() >= MIN_TRACK_SPEED)
 	    route_update_vmg();
 
+	basemap_prefetch();
+	snapshot_update();
+
 	update_stamp = now;
 	gps_state.updated = 0;
 	do_refresh = 1;
-    }
-
-    if (protocol->poll && poll_stamp + POLL_INTERVAL <= now) {
-	protocol->poll();
-	poll_stamp = now;
+	metrics_fix(&gps_state, &start);
     }
 }
 
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/* publishes our position for other programs, see gpsapp_shm.h */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "gpsapp.h"
+#include "gpsapp_shm.h"
+
+static struct gpsapp_shm *shm;
+
+void snapshot_init(void)
+{
+    int fd;
+
+    if (shm) return;
+
+    fd = open(GPSAPP_SHM_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return;
+
+    if (ftruncate(fd, sizeof(struct gpsapp_shm)) == 0) {
+	shm = mmap(NULL, sizeof(struct gpsapp_shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+	    shm = NULL;
+    }
+    close(fd);
+
+    if (!shm) return;
+
+    /* the header goes last, readers ignore the segment until then */
+    shm->size = sizeof(struct gpsapp_shm);
+    shm->version = GPSAPP_SHM_VERSION;
+    shm->next_wp = -1;
+    shm->bearing = -1;
+    barrier();
+    shm->magic = GPSAPP_SHM_MAGIC;
+}
+
+void snapshot_free(void)
+{
+    if (!shm) return;
+
+    shm->magic = 0;
+    munmap(shm, sizeof(struct gpsapp_shm));
+    unlink(GPSAPP_SHM_FILE);
+    shm = NULL;
+}
+
+void snapshot_update(void)
+{
+    struct xy pos;
+    unsigned int dist;
+    char *desc;
+
+    if (!shm) return;
+
+    write_seqlock(&shm->lock);
+
+    shm->updates++;
+    shm->state = gps_state;
+    shm->coord = gps_coord;
+    shm->center = coord_center;
+    shm->speed = gps_speed;
+    shm->bearing = gps_bearing;
+
+    if (route_getwp(nextwp, &pos, &dist, &desc)) {
+	shm->next_wp = nextwp;
+	shm->next_pos = pos;
+	shm->next_dist = dist;
+	shm->next_eta = eta_seconds(nextwp, dist);
+	strncpy(shm->next_desc, desc, sizeof(shm->next_desc) - 1);
+	shm->next_desc[sizeof(shm->next_desc) - 1] = '\0';
+    } else
+	shm->next_wp = -1;
+
+    if (route_getwp(-1, NULL, &dist, NULL)) {
+	shm->dest_dist = dist;
+	shm->dest_eta = eta_seconds(-1, dist);
+    } else {
+	shm->dest_dist = 0;
+	shm->dest_eta = -1;
+    }
+    shm->off_route = route_offroute();
+
+    write_sequnlock(&shm->lock);
+}
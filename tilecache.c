@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Tiles read from the map files are kept in memory, up to tilecache=<KB>.
+ * When that fills up the tile that was used the longest time ago goes first.
+ * A tile is read with a single read, spinning up the disk is what takes
+ * time, not reading a couple of KB more or less.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "gpsapp.h"
+#include "metrics.h"
+
+#define TILE_HASH 256
+
+struct tile {
+    int fd;
+    off_t offset;
+    int size;
+    unsigned char *data;
+    struct tile *prev, *next;	/* most recently used first */
+    struct tile *hnext;
+};
+
+int tilecache_size = 1024;	/* KB */
+
+static struct tile *hash[TILE_HASH];
+static struct tile lru;
+static int used;		/* bytes */
+
+static int tile_hash(int fd, off_t offset)
+{
+    return (fd * 31 + (unsigned int)(offset >> 4)) % TILE_HASH;
+}
+
+static void lru_remove(struct tile *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+}
+
+static void lru_insert(struct tile *t)
+{
+    if (!lru.next)
+	lru.next = lru.prev = &lru;
+
+    t->prev = &lru;
+    t->next = lru.next;
+    lru.next->prev = t;
+    lru.next = t;
+}
+
+static void tile_free(struct tile *t)
+{
+    struct tile **p;
+
+    for (p = &hash[tile_hash(t->fd, t->offset)]; *p; p = &(*p)->hnext)
+	if (*p == t) {
+	    *p = t->hnext;
+	    break;
+	}
+    lru_remove(t);
+    used -= t->size;
+    free(t->data);
+    free(t);
+}
+
+static struct tile *tile_lookup(int fd, off_t offset)
+{
+    struct tile *t;
+
+    for (t = hash[tile_hash(fd, offset)]; t; t = t->hnext)
+	if (t->fd == fd && t->offset == offset)
+	    return t;
+    return NULL;
+}
+
+int tilecache_has(int fd, off_t offset)
+{
+    return tile_lookup(fd, offset) != NULL;
+}
+
+/* returns the size bytes at offset in fd, NULL when they couldn't be read.
+ * The data stays valid until the next call */
+unsigned char *tilecache_get(int fd, off_t offset, int size)
+{
+    struct tile *t;
+    int n, done = 0;
+
+    t = tile_lookup(fd, offset);
+    if (t) {
+	METRIC_COUNT(C_TILE_HIT);
+	lru_remove(t);
+	lru_insert(t);
+	return t->data;
+    }
+
+    METRIC_COUNT(C_TILE_READ);
+    t = malloc(sizeof(*t));
+    if (!t) return NULL;
+    t->data = malloc(size);
+    if (!t->data) {
+	free(t);
+	return NULL;
+    }
+
+    if (lseek(fd, offset, SEEK_SET) == offset)
+	while (done < size && (n = read(fd, t->data + done, size - done)) > 0)
+	    done += n;
+    if (done != size) {
+	free(t->data);
+	free(t);
+	return NULL;
+    }
+
+    /* make room, but never throw out the one we just read */
+    while (used && used + size > tilecache_size * 1024)
+	tile_free(lru.prev);
+
+    t->fd = fd;
+    t->offset = offset;
+    t->size = size;
+    t->hnext = hash[tile_hash(fd, offset)];
+    hash[tile_hash(fd, offset)] = t;
+    lru_insert(t);
+    used += size;
+    return t->data;
+}
+
+/* forget all tiles of a file that is being closed */
+void tilecache_flush(int fd)
+{
+    struct tile *t, *next;
+
+    if (!lru.next)
+	return;
+
+    for (t = lru.next; t != &lru; t = next) {
+	next = t->next;
+	if (t->fd == fd)
+	    tile_free(t);
+    }
+}
@@ -4,40 +4,106 @@
  * terms of the GNU General Public License Version 2.
  */
 
+/*
+ * The track we've driven is simplified as it comes in. Positions are
+ * collected in a small window after the last point we kept, and only when
+ * one of them is more than TRACK_TOL meters off the straight line to the
+ * newest position is the previous position kept as a point of the track.
+ * Straight roads then only cost a couple of points.
+ *
+ * When the track is full, every other point of the older half is dropped.
+ * Older parts of the track are thinned more often and end up coarser, but
+ * the track goes back hours instead of minutes in the same space.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include "gpsapp.h"
 #include "vfdlib.h"
 
 #define MAX_TRACK 512
-static struct xy tracklog[MAX_TRACK];
+#define TRACK_WINDOW 32	/* positions we look back at when simplifying */
+#define TRACK_TOL 4.0	/* meters off the line before we keep a point */
+
+static struct xy tracklog[MAX_TRACK]; /* oldest point first */
 static int tracklog_size;
-static int tracklog_idx;
+
+/* positions since the last point in tracklog, the last one is where we are */
+static struct xy window[TRACK_WINDOW];
+static int window_size;
 
 void track_init(void)
 {
-    tracklog_idx = tracklog_size = 0;
+    tracklog_size = window_size = 0;
+}
+
+/* drop every other point from the older half of the track */
+static void track_thin(void)
+{
+    int i, j, half = tracklog_size / 2;
+
+    for (i = j = 1; i < half; i += 2)
+	tracklog[j++] = tracklog[i];
+    for (i = half; i < tracklog_size; i++)
+	tracklog[j++] = tracklog[i];
+    tracklog_size = j;
+}
+
+static void track_keep(const struct xy *pos)
+{
+    if (tracklog_size == MAX_TRACK)
+	track_thin();
+    tracklog[tracklog_size++] = *pos;
+}
+
+/* is any position in the window too far off the line from the last kept
+ * point to pos */
+static int track_bends(const struct xy *pos)
+{
+    const struct xy *a = &tracklog[tracklog_size - 1];
+    double dx = pos->x - a->x, dy = pos->y - a->y, cross, len2;
+    int i;
+
+    len2 = dx * dx + dy * dy;
+    for (i = 0; i < window_size; i++) {
+	cross = dx * (window[i].y - a->y) - dy * (window[i].x - a->x);
+	if (cross * cross > TRACK_TOL * TRACK_TOL * len2)
+	    return 1;
+    }
+    return 0;
 }
 
 void track_pos(void)
 {
+    const struct xy *last, *pos = &gps_coord.xy;
+
+    if (!tracklog_size) {
+	track_keep(pos);
+	return;
+    }
+
     /* no need to log the same position multiple times */
-    if (tracklog[tracklog_idx].x == gps_coord.xy.x && 
-	tracklog[tracklog_idx].y == gps_coord.xy.y)
+    last = window_size ? &window[window_size - 1] : &tracklog[tracklog_size-1];
+    if (last->x == pos->x && last->y == pos->y)
 	return;
 
-    tracklog[tracklog_idx++] = gps_coord.xy;
-    if (tracklog_size < MAX_TRACK) tracklog_size++;
-    if (tracklog_idx == MAX_TRACK) tracklog_idx = 0;
+    if (window_size == TRACK_WINDOW || (window_size && track_bends(pos))) {
+	track_keep(&window[window_size - 1]);
+	window_size = 0;
+    }
+    window[window_size++] = *pos;
 }
 
 void track_draw(void)
 {
-    int head = tracklog_idx;
+    struct xy tail[2];
 
-    if (tracklog_size == MAX_TRACK)
-	draw_lines(&tracklog[head], MAX_TRACK - head, VFDSHADE_DIM);
+    draw_lines(tracklog, tracklog_size, VFDSHADE_DIM);
 
-    draw_lines(tracklog, head, VFDSHADE_DIM);
-}
+    if (!tracklog_size || !window_size)
+	return;
 
+    tail[0] = tracklog[tracklog_size - 1];
+    tail[1] = window[window_size - 1];
+    draw_lines(tail, 2, VFDSHADE_DIM);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+ * This code is distributed "AS IS" without warranty of any kind under the
+ * terms of the GNU General Public License Version 2.
+ */
+
+/*
+ * Records where we've been to the file given with tracklog=<path>. The file
+ * is a sequence of 4KB blocks, every block starts with a header holding an
+ * absolute position and time, followed by records with the difference to the
+ * previous fix as zigzag encoded varints. Driving at 1Hz that is about 6
+ * bytes per fix.
+ *
+ * The block we're filling is kept in memory and is written out in place when
+ * it is full, or every TRACK_SYNC seconds, so the disk isn't kept spinning
+ * just for us. Every block carries a checksum, after a power failure we lose
+ * at most what was added to the last block since it was written. Read the
+ * log with trackfile.py.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "gpsapp.h"
+
+#define TRACK_BLOCK 4096
+#define TRACK_HDR   32
+#define TRACK_MAGIC "GTRK"
+#define TRACK_VERSION 1
+#define TRACK_SYNC  300		/* seconds between writes of a partial block */
+#define TRACK_MAXREC 20		/* 4 varints of at most 5 bytes */
+
+/* block header, all values little endian
+ *  0 magic, 4 version (16 bits), 6 bytes used (16 bits), 8 block sequence
+ * 12 time, 16 latitude, 20 longitude (microdegrees), 24 altitude (meters)
+ * 28 adler32 of the used part of the block with this field zeroed */
+
+char *trackfile = NULL;
+
+static int fd = -1;
+static unsigned char block[TRACK_BLOCK];
+static int used;		/* bytes used in block, 0 when it is empty */
+static off_t offset;		/* where block goes in the file */
+static unsigned int seq;
+static time_t synced;		/* when we last wrote the block */
+static int last_time, last_lat, last_lon, last_alt;
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static unsigned int adler32(const unsigned char *p, int len)
+{
+    unsigned int a = 1, b = 0;
+
+    while (len--) {
+	a = (a + *p++) % 65521;
+	b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+/* zigzag, so that small negative numbers take few bytes as well */
+static int put_varint(unsigned char *p, int v)
+{
+    unsigned int u = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+    int n = 0;
+
+    while (u >= 0x80) {
+	p[n++] = u | 0x80;
+	u >>= 7;
+    }
+    p[n++] = u;
+    return n;
+}
+
+static void trackfile_write(void)
+{
+    int n;
+
+    if (!used) return;
+
+    block[6] = used; block[7] = used >> 8;
+    put32(&block[28], 0);
+    put32(&block[28], adler32(block, used));
+
+    /* the tail of the block is zero, a partial block is written as a whole
+     * so that a later, fuller, copy simply replaces it */
+    if (lseek(fd, offset, SEEK_SET) == offset) {
+	n = write(fd, block, TRACK_BLOCK);
+	if (n == TRACK_BLOCK)
+	    fsync(fd);
+    }
+    synced = time(NULL);
+}
+
+static void trackfile_newblock(const struct gps_state *gps, int lat, int lon,
+			       int alt)
+{
+    memset(block, 0, TRACK_BLOCK);
+    memcpy(block, TRACK_MAGIC, 4);
+    block[4] = TRACK_VERSION;
+    put32(&block[8], seq++);
+    put32(&block[12], gps->time);
+    put32(&block[16], lat);
+    put32(&block[20], lon);
+    put32(&block[24], alt);
+    used = TRACK_HDR;
+
+    last_time = gps->time;
+    last_lat = lat;
+    last_lon = lon;
+    last_alt = alt;
+}
+
+void trackfile_open(void)
+{
+    struct stat st;
+
+    if (!trackfile || fd != -1)
+	return;
+
+    fd = open(trackfile, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+	return;
+
+    /* start appending after the last complete, or partial, block */
+    if (fstat(fd, &st) == 0)
+	offset = (st.st_size + TRACK_BLOCK - 1) & ~(off_t)(TRACK_BLOCK - 1);
+
+    if (offset >= TRACK_BLOCK &&
+	lseek(fd, offset - TRACK_BLOCK, SEEK_SET) == offset - TRACK_BLOCK &&
+	read(fd, block, TRACK_HDR) == TRACK_HDR &&
+	memcmp(block, TRACK_MAGIC, 4) == 0)
+	seq = block[8] | (block[9] << 8) | (block[10] << 16) |
+	      ((unsigned int)block[11] << 24);
+    seq++;
+
+    used = 0;
+    synced = time(NULL);
+}
+
+void trackfile_close(void)
+{
+    if (fd == -1)
+	return;
+
+    trackfile_write();
+    close(fd);
+    fd = -1;
+}
+
+/* called for every fix while we're moving */
+void trackfile_fix(const struct gps_state *gps)
+{
+    unsigned char rec[TRACK_MAXREC];
+    int lat, lon, alt, n;
+
+    if (fd == -1)
+	return;
+
+    lat = radtodeg(gps->lat) * 1000000.0;
+    lon = radtodeg(gps->lon) * 1000000.0;
+    alt = gps->alt;
+
+    /* the first fix of a block is stored in its header */
+    if (!used) {
+	trackfile_newblock(gps, lat, lon, alt);
+	return;
+    }
+
+    n  = put_varint(&rec[0], gps->time - last_time);
+    n += put_varint(&rec[n], lat - last_lat);
+    n += put_varint(&rec[n], lon - last_lon);
+    n += put_varint(&rec[n], alt - last_alt);
+
+    if (used + n > TRACK_BLOCK) {
+	trackfile_write();
+	offset += TRACK_BLOCK;
+	trackfile_newblock(gps, lat, lon, alt);
+	return;
+    }
+
+    memcpy(&block[used], rec, n);
+    used += n;
+    last_time = gps->time;
+    last_lat = lat;
+    last_lon = lon;
+    last_alt = alt;
+
+    if (time(NULL) >= synced + TRACK_SYNC)
+	trackfile_write();
+}
@@ -0,0 +1,57 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2002 Jan Harkes <jaharkes(at)cs.cmu.edu>
+# This code is distributed "AS IS" without warranty of any kind under the
+# terms of the GNU General Public License Version 2.
+#
+# Dumps a track recorded by gpsapp (tracklog= option in config.ini) in the
+# gpstrans format that is also read by the TRACKLOG protocol,
+#	T	09/14/2002 13:52:20	39.6513319	-83.5433006
+#
+# usage: trackfile.py <tracklog>
+#
+import sys, struct, time, zlib
+
+BLOCK = 4096
+HDR = 32
+
+def varints(data, pos, end):
+    while pos < end:
+	vals = []
+	for i in range(4):
+	    u = shift = 0
+	    while 1:
+		b = ord(data[pos])
+		pos = pos + 1
+		u = u | ((b & 0x7f) << shift)
+		shift = shift + 7
+		if b < 0x80: break
+	    # undo the zigzag encoding
+	    vals.append((u >> 1) ^ -(u & 1))
+	yield vals
+
+def dump(t, lat, lon):
+    print "T\t%s\t%.7f\t%.7f" % \
+	(time.strftime("%m/%d/%Y %H:%M:%S", time.gmtime(t)), lat / 1e6, lon / 1e6)
+
+def blocks(f):
+    while 1:
+	block = f.read(BLOCK)
+	if len(block) < HDR: return
+	if block[0:4] != 'GTRK': continue
+
+	version, used, seq, t, lat, lon, alt, csum = \
+	    struct.unpack('<HHIIiiiI', block[4:HDR])
+	if version != 1 or used > BLOCK: continue
+
+	# check the block wasn't torn by a power failure
+	check = block[0:28] + '\0\0\0\0' + block[HDR:used]
+	if zlib.adler32(check) & 0xffffffffL != csum: continue
+
+	yield block, used, t, lat, lon
+
+for block, used, t, lat, lon in blocks(open(sys.argv[1], 'rb')):
+    dump(t, lat, lon)
+    for dt, dlat, dlon, dalt in varints(block, HDR, used):
+	t, lat, lon = t + dt, lat + dlat, lon + dlon
+	dump(t, lat, lon)